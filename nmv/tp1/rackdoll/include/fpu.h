@@ -0,0 +1,21 @@
+#ifndef _INCLUDE_FPU_H_
+#define _INCLUDE_FPU_H_
+
+
+#include <smp.h>
+#include <task.h>
+#include <types.h>
+
+
+void setup_fpu(void);      /* Enable x87/SSE/AVX for tasks on this cpu */
+
+void fpu_switch(struct cpu *cpu, struct task *prev,
+		struct task *next);     /* Save prev state, arm #NM for next */
+
+int fpu_fork(struct task *child,
+	     struct task *parent);    /* Copy the parent state, -1 if no mem */
+
+void fpu_release(struct task *task);      /* Free the task state area */
+
+
+#endif
@@ -32,6 +32,7 @@
 #define INT_USER_SYSCALL        128
 #define INT_USER_ENTER_TASKS    129
 #define INT_USER_SPURIOUS       130
+#define INT_USER_TLB            131
 #define INT_USER_MAX            255
 
 
@@ -66,14 +67,27 @@ typedef void (*interrupt_handler_t)(struct interrupt_context *ctx);
 extern interrupt_handler_t  interrupt_vector[INTERRUPT_VECTOR_SIZE];
 
 
+#define TIMER_HZ                1000        /* LAPIC timer interrupts per s */
+
+extern uint64_t  tsc_khz;                       /* TSC cycles per ms */
+
+
 void remap_pic(void);
 
 void disable_pic(void);
 
 void setup_apic(void);
 
+void lapic_eoi(void);
+
+uint8_t lapic_id(void);
+
+void lapic_send(uint8_t apic_id, uint32_t icr);
+
 void setup_interrupts(void);
 
+void load_interrupts(void);
+
 
 static inline void cli(void)
 {
@@ -85,5 +99,23 @@ static inline void sti(void)
 	asm volatile ("sti");
 }
 
+/* Disable interrupts and return the previous rflags for irq_restore() */
+static inline uint64_t irq_save(void)
+{
+	uint64_t rflags;
+
+	asm volatile ("pushfq\n"
+		      "popq %0\n"
+		      "cli" : "=r" (rflags) : : "memory");
+
+	return rflags;
+}
+
+static inline void irq_restore(uint64_t rflags)
+{
+	if (rflags & (1ul << 9))                               /* RFLAGS_IF */
+		sti();
+}
+
 
 #endif
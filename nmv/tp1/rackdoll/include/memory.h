@@ -15,10 +15,17 @@
 #define PTE_FLAG_ACCESSED      	0x20
 #define PTE_FLAG_DIRTY  	0x40
 #define PTE_FLAG_HUGE   	0x80
-#define PTE_FLAG_GLOBAL 	0x100 // pas sur de ca
+#define PTE_FLAG_GLOBAL 	0x100
 #define PTE_FLAG_NO_EXECUTE    	0x200
+#define PTE_FLAG_COW    	0x400 /* software bit: copy-on-write page */
+#define PTE_FLAG_SHARED 	0x800 /* software bit: not COW across fork */
 
 // pte flags masks
+/* Memory types, through the PAT programmed by setup_tlb() */
+#define PTE_CACHE_WB    	0
+#define PTE_CACHE_WC    	PTE_FLAG_CACHED                  /* PAT entry 1 */
+#define PTE_CACHE_UC    	(PTE_FLAG_CACHED | PTE_FLAG_RAM) /* PAT entry 3 */
+
 #define PTE_IS_VALID(p)    	((p) & PTE_FLAG_VALID)
 #define PTE_IS_RW(p)      	((p) & PTE_FLAG_RW)
 #define PTE_IS_USER(p)   	((p) & PTE_FLAG_USER)
@@ -27,13 +34,16 @@
 #define PTE_IS_ACCESSED(p)	((p) & PTE_FLAG_ACCESSED)
 #define PTE_IS_DIRTY(p)		((p) & PTE_FLAG_DIRTY)
 #define PTE_IS_HUGE(p)		((p) & PTE_FLAG_HUGE)
-#define PTE_IS_GLOBAL(p)	((p) & PTE_FLAG_GLOBAL) // pas sur de ca
+#define PTE_IS_GLOBAL(p)	((p) & PTE_FLAG_GLOBAL)
 #define PTE_IS_NO_EXECUTE(p)	((p) & PTE_FLAG_NO_EXECUTE)
+#define PTE_IS_COW(p)		((p) & PTE_FLAG_COW)
+#define PTE_IS_SHARED(p)	((p) & PTE_FLAG_SHARED)
 
 // pte addr makss
                                 
 #define _PTE_ADDR_MASK		0xffffffff000
 #define PTE_NEXT_ADDR(p)	((p) & _PTE_ADDR_MASK)
+#define PTE_FLAGS(p)		((p) & ~_PTE_ADDR_MASK)
 
 #define _PTE_MASK_PML1 0x1ff000
 #define _PTE_MASK_PML2 0x3fe00000
@@ -47,25 +57,98 @@
 #define PTE_GET_INDEX_FOR_LVL(v, lvl) ((v) >> (12 + (9 * ((lvl) - 1))) & 0x1ff)
 
 
+#define FRAME_NR_ORDERS		10
+
+
+struct frame_stats
+{
+	size_t   total_pages;                 /* pages managed by the allocator */
+	size_t   free_pages;                         /* pages currently free */
+	size_t   free_blocks[FRAME_NR_ORDERS];       /* free blocks per order */
+	uint8_t  largest_order;                 /* order of the largest free block */
+	size_t   fragmentation;      /* % of free memory outside largest blocks */
+	size_t   zeroed_pages;             /* pages waiting in the zeroed pool */
+	uint64_t zeroed_hits;         /* alloc_zeroed_page() served by the pool */
+	uint64_t zeroed_misses;              /* ... and zeroed on the spot */
+};
+
+
+void setup_memory(void);              /* Setup the physical frame allocator */
+
+void setup_tlb(void);            /* Enable PGE, PCIDs and the TLB counter */
+
+paddr_t alloc_pages(uint8_t order);     /* Allocate 2^order contiguous pages */
+
+void free_pages(paddr_t addr, uint8_t order);  /* Release alloc_pages() block */
+
 paddr_t alloc_page(void);        /* Allocate a physical page identity mapped */
 
 void free_page(paddr_t addr);  /* Release a page allocated with alloc_page() */
 
+paddr_t alloc_zeroed_page(void);    /* Same, filled with zeros, from the pool */
+
+size_t refill_zeroed_pages(void);         /* Idle time zeroing, lock held */
+
+void split_pages(paddr_t addr, uint8_t order); /* Block -> 2^order pages */
+
+void clear_page(paddr_t addr);                 /* Fill a page with zeros */
+
+void copy_page(paddr_t dst, paddr_t src);
+
+void clear_pages(paddr_t addr, uint8_t order);   /* Same for 2^order pages */
+
+void copy_pages(paddr_t dst, paddr_t src, uint8_t order);
+
+void ref_page(paddr_t addr);    /* Take a new reference on an allocated page */
+
+size_t page_refs(paddr_t addr);      /* Number of references held on a page */
+
+void get_frame_stats(struct frame_stats *st);    /* Allocator usage summary */
+
+void print_frame_stats(void);
+
 void print_pgt(paddr_t pml, uint8_t level);
 
 void map_page(struct task *ctx, vaddr_t vaddr, paddr_t paddr);
 
-void load_task(struct task *ctx);
+int map_huge_page(struct task *ctx, vaddr_t vaddr, paddr_t paddr);
+
+int load_task(struct task *ctx);      /* New task address space, 0 or -1 */
 
 void set_task(struct task *ctx);
 
-void duplicate_task(struct task *ctx);
+void unset_task(void);           /* Back to the kernel page table when idle */
+
+int duplicate_task(struct task *ctx);    /* Copy-on-write fork, 0 or -1 */
+
+void free_task(struct task *ctx);      /* Release the task address space */
+
+int mmap(struct task *ctx, vaddr_t vaddr);    /* 0, or -1 if not user */
 
-void mmap(struct task *ctx, vaddr_t vaddr);
+int mmap_huge(struct task *ctx, vaddr_t vaddr, size_t len);
+
+int mmap_range(struct task *ctx, vaddr_t vaddr, size_t len);
 
 void munmap(struct task *ctx, vaddr_t vaddr);
 
+int64_t shm_create(struct task *ctx, vaddr_t name,
+		   size_t size);     /* New named region, its size or -1 */
+
+int64_t shm_attach(struct task *ctx, vaddr_t name,
+		   vaddr_t vaddr);     /* Map a named region, its size or -1 */
+
+size_t munmap_range(struct task *ctx, vaddr_t vaddr, size_t len);
+
 void pgfault(struct interrupt_context *ctx);
 
+int copy_from_user(struct task *ctx, void *dst, vaddr_t src,
+		   size_t len);               /* 0, or -1 on a bad address */
+
+int64_t strncpy_from_user(struct task *ctx, char *dst, vaddr_t src,
+			  size_t len);  /* strlen (at most len) or -1 */
+
+paddr_t user_paddr(struct task *ctx,
+		   vaddr_t vaddr);     /* Frame of a writable word, 0 if none */
+
 
 #endif
@@ -6,6 +6,45 @@
 #include <types.h>
 
 
+/*
+ * Kernel log: printk() formats its message and appends it to log_ring,
+ * then log_flush() copies the new text to the screen. The ring lives at
+ * the log_ring symbol and starts with a magic string so a memory dump
+ * (e.g. QEMU "pmemsave" or "x/s log_ring.data") can find it: byte n of the
+ * log is data[n % LOG_RING_SIZE], the last LOG_RING_SIZE bytes before
+ * committed are valid.
+ */
+#define LOG_RING_SIZE    (1ul << 16)          /* power of two */
+#define LOG_RING_MAGIC   "RDLOGv1"
+#define LOG_LINE_MAX     256         /* longer printk() are truncated */
+
+struct log_ring
+{
+	char               magic[8];
+	uint64_t           size;
+	volatile uint64_t  reserved;         /* bytes claimed by writers */
+	volatile uint64_t  committed;        /* bytes fully written */
+	volatile uint64_t  flushed;          /* bytes sent to the screen */
+	char               data[LOG_RING_SIZE];
+};
+
+extern struct log_ring  log_ring;
+
+
+#define LOG_CONSOLE_VGA     (1u << 0)
+#define LOG_CONSOLE_SERIAL  (1u << 1)
+
+
+/*
+ * Select the consoles from a "console=vga,serial" option of the kernel
+ * command line, VGA only when there is none.
+ */
+void setup_console(const char *cmdline);
+
+size_t log_flush(void);       /* Send the new log text to the consoles */
+
+void log_defer(bool_t defer);  /* Let the timer call log_flush() instead */
+
 size_t printk(const char *format, ...);
 
 size_t vprintk(const char *format, va_list ap);
@@ -0,0 +1,13 @@
+#ifndef _INCLUDE_SERIAL_H_
+#define _INCLUDE_SERIAL_H_
+
+
+#include <types.h>
+
+
+int setup_serial(void);       /* Setup COM1, return -1 if there is none */
+
+void serial_write(const char *str, size_t n);
+
+
+#endif
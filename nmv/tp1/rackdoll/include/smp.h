@@ -0,0 +1,82 @@
+#ifndef _INCLUDE_SMP_H_
+#define _INCLUDE_SMP_H_
+
+
+#include <idt.h>
+#include <task.h>
+#include <types.h>
+
+
+#define SMP_MAX_CPUS      8
+#define SCHED_NR_LEVELS   8
+#define CPU_STACK_SIZE    0x2000
+
+
+struct run_queue
+{
+	struct task  *head;
+	struct task  *tail;
+};
+
+/*
+ * Everything a processor owns. The scheduler fields are only accessed
+ * with the kernel lock held, except for the TLB shootdown request which is
+ * how other processors talk to this one while they hold the lock.
+ */
+struct cpu
+{
+	uint64_t                   syscall_rsp;  /* see syscall.S, must be first */
+	uint64_t                   user_rsp;     /* scratch for syscall.S */
+	struct task_state_segment  tss;
+	uint8_t                    id;           /* index in cpus */
+	uint8_t                    apic_id;
+	uint8_t                    idle;         /* spinning in the idle loop */
+
+	uint64_t                   idle_ksp;     /* idle loop, see switch_to */
+	struct task               *dead;         /* exited, freed after switch */
+	struct task               *fpu_owner;    /* state in the FPU registers */
+	uint8_t                    fpu_active;   /* CR0.TS clear, owner running */
+	struct run_queue           run_queue[SCHED_NR_LEVELS];
+	uint32_t                   run_levels;   /* bit l: run_queue[l] used */
+	size_t                     nr_ready;     /* tasks in the run queues */
+	struct task               *running;      /* task owning the cpu or NULL */
+	uint64_t                   run_start;    /* TSC when running started */
+	uint64_t                   sched_ticks;  /* timer ticks since boost */
+
+	paddr_t                    pgt;          /* page table in CR3 */
+	struct task               *tlb_owner;    /* charged with TLB misses */
+	uint64_t                   tlb_last;     /* PMC0 at the last switch */
+
+	volatile uint8_t           flush_pending;
+	paddr_t                    flush_pgt;    /* shootdown request */
+	vaddr_t                    flush_start;
+	vaddr_t                    flush_end;
+
+	uint8_t  kernel_stack[CPU_STACK_SIZE] __attribute__((aligned(16)));
+	uint8_t  idle_stack[CPU_STACK_SIZE] __attribute__((aligned(16)));
+} __attribute__((aligned(0x1000)));
+
+
+extern struct cpu  cpus[SMP_MAX_CPUS];
+extern size_t      nr_cpus;                     /* processors online */
+
+
+struct cpu *this_cpu(void);                /* Processor running the caller */
+
+void setup_smp(void);             /* Start the application processors */
+
+void lock_kernel(void);          /* Take the (recursive) big kernel lock */
+
+void unlock_kernel(void);
+
+void send_ipi(uint8_t apic_id, uint8_t vector);
+
+void udelay(uint64_t us);                /* Busy wait, needs setup_apic() */
+
+void tlb_shootdown(paddr_t pgt, vaddr_t start,
+		   vaddr_t end);  /* Flush pgt entries on other processors */
+
+void tlb_flush_request(void);     /* Handle a shootdown sent to this cpu */
+
+
+#endif
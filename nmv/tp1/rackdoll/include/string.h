@@ -15,20 +15,44 @@ static inline size_t strlen(const char *str)
 	return (ptr - str);
 }
 
-static inline void memset(void *addr, uint8_t c, size_t len)
+static inline int strcmp(const char *a, const char *b)
 {
-	size_t i;
+	while (*a != '\0' && *a == *b) {
+		a++;
+		b++;
+	}
 
-	for (i = 0; i < len; i++)
-		((char *) addr)[i] = c;
+	return ((unsigned char) *a - (unsigned char) *b);
 }
 
-static inline void memcpy(void *dest, const void *src, size_t len)
+/*
+ * String instructions: the direction flag is clear in kernel code (see
+ * trap.pl and setup_syscalls) and in tasks (System V ABI).
+ * memset stores 8 bytes at a time then the tail, memcpy relies on the fast
+ * "rep movsb" of recent processors (ERMS) which picks the best width.
+ */
+static inline void memset(void *addr, uint8_t c, size_t len)
 {
-	size_t i;
+	uint64_t pattern = 0x0101010101010101ul * c;
+	size_t words = len >> 3;
+	size_t tail = len & 7;
+
+	asm volatile ("rep stosq"
+		      : "+D" (addr), "+c" (words)
+		      : "a" (pattern)
+		      : "memory");
+	asm volatile ("rep stosb"
+		      : "+D" (addr), "+c" (tail)
+		      : "a" (pattern)
+		      : "memory");
+}
 
-	for (i = 0; i < len; i++)
-		((uint8_t *) dest)[i] = ((uint8_t *) src)[i];
+static inline void memcpy(void *dest, const void *src, size_t len)
+{
+	asm volatile ("rep movsb"
+		      : "+D" (dest), "+S" (src), "+c" (len)
+		      :
+		      : "memory");
 }
 
 
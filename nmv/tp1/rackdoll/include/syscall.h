@@ -8,13 +8,25 @@
 
 #define TASK_HEADER_MAGIC  0xff10ADa64bC0DEff
 
-#define SYSCALL_PRINT      (0ul)
-#define SYSCALL_PRINTNUM   (1ul)
-#define SYSCALL_MMAP       (2ul)
-#define SYSCALL_MUNMAP     (3ul)
-#define SYSCALL_YIELD      (4ul)
-#define SYSCALL_EXIT       (5ul)
-#define SYSCALL_FORK       (6ul)
+#define SYSCALL_PRINT         (0ul)
+#define SYSCALL_PRINTNUM      (1ul)
+#define SYSCALL_MMAP          (2ul)
+#define SYSCALL_MUNMAP        (3ul)
+#define SYSCALL_YIELD         (4ul)
+#define SYSCALL_EXIT          (5ul)
+#define SYSCALL_FORK          (6ul)
+#define SYSCALL_MMAP_HUGE     (7ul)
+#define SYSCALL_MMAP_RANGE    (8ul)
+#define SYSCALL_MUNMAP_RANGE  (9ul)
+#define SYSCALL_NOP           (10ul)
+#define SYSCALL_RING_ENTER    (11ul)
+#define SYSCALL_WAIT          (12ul)
+#define SYSCALL_WAKE          (13ul)
+#define SYSCALL_SHM_CREATE    (14ul)
+#define SYSCALL_SHM_ATTACH    (15ul)
+#define SYSCALL_FPU_RESTORES  (16ul)
+
+#define SYSCALL_MAX_ARGS      6
 
 
 struct task_header
@@ -30,6 +42,75 @@ struct task_header
 void setup_syscalls(void);
 
 
+/*
+ * Asynchronous system calls: every task has a ring page mapped at
+ * SYSCALL_RING_VADDR, just below its stack. The task queues requests in
+ * sq and calls SYSCALL_RING_ENTER once, the kernel runs them in order and
+ * posts one completion per request in cq.
+ * Heads are only written by the consumer, tails by the producer. Only
+ * the calls which do not switch task can be queued (not yield, exit, fork,
+ * wait nor ring enter), others complete with -1.
+ */
+#define SYSCALL_RING_VADDR    0x40000000
+#define SYSCALL_RING_ENTRIES  32
+
+struct syscall_sqe
+{
+	uint64_t  callnum;
+	uint64_t  args[SYSCALL_MAX_ARGS];
+	uint64_t  user_data;             /* copied as is in the completion */
+};
+
+struct syscall_cqe
+{
+	uint64_t  user_data;
+	int64_t   result;
+};
+
+struct syscall_ring
+{
+	uint32_t            sq_head;                   /* written by kernel */
+	uint32_t            sq_tail;                     /* written by task */
+	uint32_t            cq_head;                     /* written by task */
+	uint32_t            cq_tail;                   /* written by kernel */
+	struct syscall_sqe  sq[SYSCALL_RING_ENTRIES];
+	struct syscall_cqe  cq[SYSCALL_RING_ENTRIES];
+};
+
+
+/*
+ * Named shared regions: SYSCALL_SHM_CREATE makes a zero filled region of
+ * the given size (rounded up to pages), SYSCALL_SHM_ATTACH maps it at a
+ * page aligned address of the caller. Every task attached to a region, and
+ * every child they fork, sees the same frames. Regions are never removed.
+ */
+#define SHM_NAME_MAX          32                  /* final '\0' included */
+#define SHM_MAX_SIZE          0x200000
+
+/*
+ * Single-producer single-consumer ring laid in a shared region. Slots are
+ * written in place by the producer and read in place by the consumer: the
+ * kernel copies nothing, it is only called to put a side with nothing to
+ * do to sleep (see shm_ring_wait). A zero filled ring is empty.
+ * Each index sits in its own cache line with the flag of the side which
+ * sleeps on it, so that both sides do not fight for a single line.
+ */
+#define SHM_RING_SLOTS        32
+#define SHM_RING_SLOT_SIZE    1024
+#define SHM_RING_SPIN         256          /* polls before going to sleep */
+
+struct shm_ring
+{
+	uint32_t  head;                                 /* written by consumer */
+	uint32_t  full_waiter;                    /* producer sleeps on head */
+	uint8_t   pad0[56];
+	uint32_t  tail;                                 /* written by producer */
+	uint32_t  empty_waiter;                   /* consumer sleeps on tail */
+	uint8_t   pad1[56];
+	uint8_t   slots[SHM_RING_SLOTS][SHM_RING_SLOT_SIZE];
+};
+
+
 struct syscall_context
 {
 	uint64_t  callnum;
@@ -38,13 +119,58 @@ struct syscall_context
 	uint64_t  rsp;
 } __attribute__((packed));
 
-static inline int syscall(size_t callnum, uint64_t arg0)
+/*
+ * System calls take the call number in %rax and up to six arguments in
+ * %rdi, %rsi, %rdx, %r10, %r8 and %r9 (SYSCALL overwrites %rcx and %r11).
+ * The result comes back in %rax, negative on error. Pointer arguments are
+ * checked by the kernel: a bad one makes the call fail, not the task.
+ */
+static inline int64_t syscall6(size_t callnum, uint64_t arg0, uint64_t arg1,
+			       uint64_t arg2, uint64_t arg3, uint64_t arg4,
+			       uint64_t arg5)
+{
+	register uint64_t r10 asm ("r10") = arg3;
+	register uint64_t r8 asm ("r8") = arg4;
+	register uint64_t r9 asm ("r9") = arg5;
+	int64_t ret;
+
+	asm volatile ("syscall\n"
+		      : "=a" (ret)
+		      : "a" (callnum), "D" (arg0), "S" (arg1), "d" (arg2),
+			"r" (r10), "r" (r8), "r" (r9)
+		      : "rcx", "r11", "memory");
+
+	return ret;
+}
+
+static inline int64_t syscall3(size_t callnum, uint64_t arg0, uint64_t arg1,
+			       uint64_t arg2)
+{
+	return syscall6(callnum, arg0, arg1, arg2, 0, 0, 0);
+}
+
+static inline int64_t syscall2(size_t callnum, uint64_t arg0, uint64_t arg1)
 {
-	int ret;
+	return syscall6(callnum, arg0, arg1, 0, 0, 0, 0);
+}
+
+static inline int64_t syscall(size_t callnum, uint64_t arg0)
+{
+	return syscall6(callnum, arg0, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Same call through int $0x80. INT_USER_SYSCALL is an interrupt gate: the
+ * kernel is entered with IF clear, as SYSCALL does with SFMASK.
+ */
+static inline int64_t int_syscall(size_t callnum, uint64_t arg0)
+{
+	int64_t ret;
 
 	asm volatile ("int $0x80\n"
 		      : "=a" (ret)
-		      : "D" (callnum), "S" (arg0));
+		      : "a" (callnum), "D" (arg0)
+		      : "memory");
 
 	return ret;
 }
@@ -60,9 +186,14 @@ static inline void syscall_printnum(uint64_t num)
 	syscall(SYSCALL_PRINTNUM, num);
 }
 
-static inline void syscall_mmap(vaddr_t addr)
+static inline int syscall_mmap(vaddr_t addr)
 {
-	syscall(SYSCALL_MMAP, addr);
+	return syscall(SYSCALL_MMAP, addr);
+}
+
+static inline int syscall_mmap_huge(vaddr_t addr, size_t len)
+{
+	return syscall2(SYSCALL_MMAP_HUGE, addr, len);
 }
 
 static inline void syscall_munmap(vaddr_t addr)
@@ -70,6 +201,167 @@ static inline void syscall_munmap(vaddr_t addr)
 	syscall(SYSCALL_MUNMAP, addr);
 }
 
+static inline int syscall_mmap_range(vaddr_t addr, size_t len)
+{
+	return syscall2(SYSCALL_MMAP_RANGE, addr, len);
+}
+
+static inline void syscall_munmap_range(vaddr_t addr, size_t len)
+{
+	syscall2(SYSCALL_MUNMAP_RANGE, addr, len);
+}
+
+static inline void syscall_nop(void)
+{
+	syscall(SYSCALL_NOP, 0);
+}
+
+/*
+ * Sleep as long as the 32-bit word at addr holds expected, until a wake on
+ * the same word. Return 0 once woken, 1 if the word already changed or -1
+ * on a bad address. Tasks which share the frame of the word (not a COW
+ * copy of it) share its waiters, whatever the address they map it at.
+ */
+static inline int syscall_wait(volatile uint32_t *addr, uint32_t expected)
+{
+	return syscall2(SYSCALL_WAIT, (uint64_t) addr, expected);
+}
+
+/* Wake up to n tasks waiting on addr, return how many or -1 */
+static inline int syscall_wake(volatile uint32_t *addr, size_t n)
+{
+	return syscall2(SYSCALL_WAKE, (uint64_t) addr, n);
+}
+
+/* Create a region, return its size or -1 if the name is already used */
+static inline int64_t syscall_shm_create(const char *name, size_t size)
+{
+	return syscall2(SYSCALL_SHM_CREATE, (uint64_t) name, size);
+}
+
+/* Map a region at vaddr, return its size or -1 */
+static inline int64_t syscall_shm_attach(const char *name, vaddr_t vaddr)
+{
+	return syscall2(SYSCALL_SHM_ATTACH, (uint64_t) name, vaddr);
+}
+
+/*
+ * Return once *word no longer holds old. The flag is raised before the
+ * last check: the other side stores the word before it reads the flag,
+ * so either this side sees the new value or the other one wakes it up.
+ */
+static inline void shm_ring_wait(uint32_t *word, uint32_t old,
+				 uint32_t *waiter)
+{
+	size_t i;
+
+	for (i = 0; i < SHM_RING_SPIN; i++) {
+		if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old)
+			return;
+		asm volatile ("pause");
+	}
+
+	__atomic_store_n(waiter, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == old)
+		syscall_wait(word, old);
+	__atomic_store_n(waiter, 0, __ATOMIC_RELAXED);
+}
+
+static inline void shm_ring_notify(uint32_t *word, uint32_t *waiter)
+{
+	if (__atomic_exchange_n(waiter, 0, __ATOMIC_SEQ_CST))
+		syscall_wake(word, 1);
+}
+
+/* Next slot to fill, waits while the ring is full */
+static inline void *shm_ring_reserve(struct shm_ring *ring)
+{
+	uint32_t tail = ring->tail;
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (tail - head == SHM_RING_SLOTS)
+		shm_ring_wait(&ring->head, head, &ring->full_waiter);
+
+	return ring->slots[tail % SHM_RING_SLOTS];
+}
+
+/* Hand the slot given by shm_ring_reserve() to the consumer */
+static inline void shm_ring_publish(struct shm_ring *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+	shm_ring_notify(&ring->tail, &ring->empty_waiter);
+}
+
+/* Oldest filled slot, waits while the ring is empty */
+static inline void *shm_ring_peek(struct shm_ring *ring)
+{
+	uint32_t head = ring->head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		shm_ring_wait(&ring->tail, tail, &ring->empty_waiter);
+
+	return ring->slots[head % SHM_RING_SLOTS];
+}
+
+/* Give the slot read with shm_ring_peek() back to the producer */
+static inline void shm_ring_release(struct shm_ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+	shm_ring_notify(&ring->head, &ring->full_waiter);
+}
+
+static inline struct syscall_ring *syscall_ring(void)
+{
+	return (struct syscall_ring *) SYSCALL_RING_VADDR;
+}
+
+/* Queue a request, return -1 if the submission queue is full */
+static inline int ring_submit(size_t callnum, uint64_t arg0, uint64_t arg1,
+			      uint64_t user_data)
+{
+	struct syscall_ring *ring = syscall_ring();
+	uint32_t tail = ring->sq_tail;
+	struct syscall_sqe *sqe;
+
+	if (tail - __atomic_load_n(&ring->sq_head, __ATOMIC_ACQUIRE)
+	    == SYSCALL_RING_ENTRIES)
+		return -1;
+
+	sqe = ring->sq + (tail % SYSCALL_RING_ENTRIES);
+	sqe->callnum = callnum;
+	sqe->args[0] = arg0;
+	sqe->args[1] = arg1;
+	sqe->args[2] = 0;
+	sqe->args[3] = 0;
+	sqe->args[4] = 0;
+	sqe->args[5] = 0;
+	sqe->user_data = user_data;
+
+	__atomic_store_n(&ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Take the oldest completion, return -1 if there is none */
+static inline int ring_reap(struct syscall_cqe *cqe)
+{
+	struct syscall_ring *ring = syscall_ring();
+	uint32_t head = ring->cq_head;
+
+	if (head == __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE))
+		return -1;
+
+	*cqe = ring->cq[head % SYSCALL_RING_ENTRIES];
+	__atomic_store_n(&ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Run the queued requests, return how many were run */
+static inline int syscall_ring_enter(void)
+{
+	return syscall(SYSCALL_RING_ENTER, 0);
+}
+
 static inline void syscall_yield(void)
 {
 	syscall(SYSCALL_YIELD, 0);
@@ -80,6 +372,12 @@ static inline void syscall_exit(void)
 	syscall(SYSCALL_EXIT, 0);
 }
 
+/* Times the SIMD state of the task was loaded on a #NM trap */
+static inline uint64_t syscall_fpu_restores(void)
+{
+	return syscall(SYSCALL_FPU_RESTORES, 0);
+}
+
 static inline int syscall_fork(void)
 {
 	return syscall(SYSCALL_FORK, 0);
@@ -3,16 +3,46 @@
 
 
 #include <idt.h>
+#include <vma.h>
+
+
+#define TASK_READY        0                     /* waiting in a run queue */
+#define TASK_RUNNING      1                              /* owns the cpu */
+#define TASK_BLOCKED      2        /* off the run queues until wake_task() */
+
+#define TASK_KSTACK_ORDER 1                   /* kernel stack of 8 KiB */
+#define TASK_KSTACK_SIZE  (0x1000ul << TASK_KSTACK_ORDER)
 
 
 struct task
 {
 	paddr_t                   pgt;                   /* page table paddr */
+	paddr_t                   ring;       /* syscall ring page, see syscall.h */
 	paddr_t                   load_paddr;      /* paddr of the task code */
 	paddr_t                   load_end_paddr;    /* paddr following code */
 	vaddr_t                   load_vaddr;        /* vaddr for load_paddr */
 	vaddr_t                   bss_end_vaddr;      /* vaddr following bss */
-	struct interrupt_context  context;       /* task registers save area */
+	uint16_t                  pcid;       /* address space TLB tag (or 0) */
+	uint32_t                  tlb_stale;   /* cpus with stale PCID entries */
+	uint64_t                  switches;       /* times the task got the cpu */
+	uint64_t                  runtime;     /* TSC cycles spent on the cpu */
+	uint32_t                  slice;   /* timer ticks left before preemption */
+	uint64_t                  tlb_misses;   /* TLB misses while running */
+	uint64_t                  faults;      /* page faults taken by the task */
+	uint64_t                  fault_pages;     /* pages mapped by faults */
+	struct vma                vmas[TASK_VMA_MAX];     /* address space map */
+	uint8_t                   vma_root;          /* root of the area tree */
+	uint8_t                   vma_free;       /* first unused slot in vmas */
+	vaddr_t                   kstack;   /* kernel stack, user regs on top */
+	uint64_t                  ksp;    /* kernel rsp saved by switch_to() */
+	paddr_t                   fpu;   /* x87/SSE/AVX state area, see fpu.c */
+	uint8_t                   fpu_cpu;    /* processor which loaded fpu */
+	uint64_t                  fpu_restores;   /* #NM traps taken by task */
+	struct task              *next;   /* next task in the run/wait queue */
+	paddr_t                   wait_key;  /* paddr of the word waited for */
+	uint8_t                   level;         /* run queue, 0 is the highest */
+	uint8_t                   state;       /* TASK_READY, _RUNNING, _BLOCKED */
+	uint8_t                   cpu;         /* processor which ran it last */
 };
 
 
@@ -42,18 +72,22 @@ struct task_state_segment
 	uint64_t iopb;
 } __attribute__((packed));
 
-extern struct task_state_segment tss;
 
+void setup_tss(void);             /* Setup user mode switch for this cpu */
 
-void setup_tss(void);                              /* Setup user mode switch */
+const char *mb2_cmdline(const void *mb2);   /* Kernel command line or NULL */
 
 void load_tasks(const void *mb2);        /* Load tasks from multiboot 2 info */
 
 struct task *current(void);                          /* Get the current task */
 
-void next_task(struct interrupt_context *ctx);        /* Go to the next task */
+void next_task(void);                                 /* Go to the next task */
+
+void block_task(void);              /* Sleep in the kernel until wake_task */
+
+void wake_task(struct task *task);       /* Make a blocked task ready again */
 
-void exit_task(struct interrupt_context *ctx);      /* Exit the current task */
+void exit_task(void);                              /* Exit the current task */
 
 void fork_task(struct interrupt_context *ctx);      /* Fork the current task */
 
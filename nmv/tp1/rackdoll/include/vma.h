@@ -0,0 +1,55 @@
+#ifndef _INCLUDE_VMA_H_
+#define _INCLUDE_VMA_H_
+
+
+#include <types.h>
+
+
+#define TASK_VMA_MAX      32
+#define VMA_NIL           0xff         /* no area, index out of the table */
+
+#define VMA_ANONYMOUS     0               /* zero filled on first access */
+#define VMA_IMAGE         1        /* backed by the task image (multiboot) */
+#define VMA_SHARED        2      /* zero filled or a named region, not COW */
+
+#define VMA_READ          0x1
+#define VMA_WRITE         0x2
+#define VMA_EXEC          0x4
+
+
+struct task;
+
+/*
+ * A contiguous range of the user address space with the same backing and
+ * permissions. The areas of a task never overlap and live in a red-black
+ * tree ordered by address. The tree is stored in the task itself and its
+ * links are indices in the task table of areas, so that a task can be
+ * copied by value (fork, scheduler queue).
+ */
+struct vma
+{
+	vaddr_t  start;                        /* first vaddr of the area */
+	vaddr_t  end;                       /* vaddr following the area */
+	paddr_t  paddr;              /* frame backing start, 0 if zero filled */
+	uint8_t  type;                /* VMA_ANONYMOUS, VMA_IMAGE, VMA_SHARED */
+	uint8_t  prot;                   /* VMA_READ | VMA_WRITE | VMA_EXEC */
+	uint8_t  color;                         /* red-black tree node color */
+	uint8_t  parent;
+	uint8_t  left;                    /* areas before start in the tree */
+	uint8_t  right;   /* areas after end in the tree, next free if unused */
+};
+
+
+void init_vmas(struct task *ctx);          /* Empty the areas of a task */
+
+int add_vma(struct task *ctx, vaddr_t start, vaddr_t end, uint8_t type,
+	    uint8_t prot, paddr_t paddr);   /* Declare a new area for a task */
+
+int remove_vmas(struct task *ctx, vaddr_t start,
+		vaddr_t end);          /* Forget [start, end), split if needed */
+
+const struct vma *find_vma(struct task *ctx,
+			   vaddr_t vaddr);   /* Area containing vaddr or NULL */
+
+
+#endif
@@ -35,6 +35,65 @@
 #define MSR_EFER_FFXSR         (1ul << 14)
 #define MSR_EFER_TCE           (1ul << 15)
 
+#define MSR_STAR               0xc0000081
+#define MSR_LSTAR              0xc0000082
+#define MSR_SFMASK             0xc0000084
+#define MSR_KERNEL_GS_BASE     0xc0000102
+
+#define MSR_PAT                0x277
+#define PAT_UC                 0x00ul              /* uncacheable */
+#define PAT_WC                 0x01ul              /* write-combining */
+#define PAT_WT                 0x04ul              /* write-through */
+#define PAT_WB                 0x06ul              /* write-back */
+#define PAT_UC_MINUS           0x07ul              /* UC, MTRR may say WC */
+#define PAT_ENTRY(i, type)     ((type) << ((i) * 8))
+
+
+/*
+ * Performance monitoring MSRs (architectural performance monitoring).
+ */
+
+#define MSR_PERFEVTSEL0        0x186
+#define MSR_PMC0               0xc1
+#define MSR_PERF_GLOBAL_CTRL   0x38f
+#define PERFEVTSEL_USR         (1ul << 16)
+#define PERFEVTSEL_OS          (1ul << 17)
+#define PERFEVTSEL_EN          (1ul << 22)
+
+
+/*
+ * Control registers definitions.
+ */
+
+#define CR0_MP                 (1ul <<  1)
+#define CR0_EM                 (1ul <<  2)
+#define CR0_TS                 (1ul <<  3)
+
+#define CR3_PCID_MASK          0xffful
+#define CR3_NOFLUSH            (1ul << 63)
+
+#define CR4_PGE                (1ul <<  7)
+#define CR4_OSFXSR             (1ul <<  9)
+#define CR4_OSXMMEXCPT         (1ul << 10)
+#define CR4_PCIDE              (1ul << 17)
+#define CR4_OSXSAVE            (1ul << 18)
+
+#define XCR0_X87               (1ul <<  0)
+#define XCR0_SSE               (1ul <<  1)
+#define XCR0_AVX               (1ul <<  2)
+
+
+/*
+ * CPUID feature bits.
+ */
+
+#define CPUID1_EDX_FXSR        (1u << 24)
+#define CPUID1_ECX_PCID        (1u << 17)
+#define CPUID1_ECX_XSAVE       (1u << 26)
+#define CPUID1_ECX_AVX         (1u << 28)
+#define CPUIDD1_EAX_XSAVEOPT   (1u <<  0)
+#define CPUID7_EBX_INVPCID     (1u << 10)
+
 
 /*
  * Rflags definitions.
@@ -59,6 +118,15 @@
 #define RFLAGS_ID              (1ul << 21)
 
 
+static inline uint64_t store_rflags(void)
+{
+	uint64_t rflags;
+	asm volatile ("pushfq\n"
+		      "popq %0" : "=r" (rflags));
+	return rflags;
+}
+
+
 static inline void load_rsp(uint64_t rsp)
 {
 	asm volatile ("movq %0, %%rsp" : : "r" (rsp));
@@ -72,6 +140,24 @@ static inline uint64_t store_rsp(void)
 }
 
 
+static inline void load_cr0(uint64_t cr0)
+{
+	asm volatile ("movq %0, %%cr0" : : "r" (cr0));
+}
+
+static inline uint64_t store_cr0(void)
+{
+	uint64_t cr0;
+	asm volatile ("movq %%cr0, %0" : "=r" (cr0));
+	return cr0;
+}
+
+static inline void clts(void)
+{
+	asm volatile ("clts");
+}
+
+
 static inline void load_cr2(uint64_t cr2)
 {
 	asm volatile ("movq %0, %%cr2" : : "a" (cr2));
@@ -98,6 +184,19 @@ static inline uint64_t store_cr3(void)
 }
 
 
+static inline void load_cr4(uint64_t cr4)
+{
+	asm volatile ("movq %0, %%cr4" : : "r" (cr4));
+}
+
+static inline uint64_t store_cr4(void)
+{
+	uint64_t cr4;
+	asm volatile ("movq %%cr4, %0" : "=r" (cr4));
+	return cr4;
+}
+
+
 static inline void load_tr(uint16_t tr)
 {
 	asm volatile ("ltr %0" : : "r" (tr));
@@ -116,6 +215,41 @@ static inline void invlpg(vaddr_t vaddr)
 	asm volatile ("invlpg (%0)" : : "r" (vaddr) : "memory");
 }
 
+#define INVPCID_ADDRESS        0      /* one address in one PCID */
+#define INVPCID_CONTEXT        1      /* all addresses in one PCID */
+
+static inline void invpcid(uint64_t type, uint16_t pcid, vaddr_t vaddr)
+{
+	struct {
+		uint64_t pcid;
+		uint64_t vaddr;
+	} desc = { pcid, vaddr };
+
+	asm volatile ("invpcid %0, %1" : : "m" (desc), "r" (type) : "memory");
+}
+
+static inline void wbinvd(void)
+{
+	asm volatile ("wbinvd" : : : "memory");
+}
+
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t eax, edx;
+	asm volatile ("rdtsc" : "=a" (eax), "=d" (edx));
+	return (((uint64_t) edx) << 32) | eax;
+}
+
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax,
+			 uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+	asm volatile ("cpuid"
+		      : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+		      : "a" (leaf), "c" (subleaf));
+}
+
 
 typedef uint16_t  port_t;
 
@@ -166,6 +300,12 @@ static inline void wrmsr(uint32_t msr, uint64_t val)
 	asm volatile ("wrmsr" : : "a" (eax), "c" (msr), "d" (edx));
 }
 
+static inline void xsetbv(uint32_t xcr, uint64_t val)
+{
+	asm volatile ("xsetbv" : : "c" (xcr), "a" ((uint32_t) val),
+		      "d" ((uint32_t) (val >> 32)));
+}
+
 static inline uint64_t rdmsr(uint32_t msr)
 {
 	uint32_t eax, edx;
@@ -0,0 +1,189 @@
+#include <fpu.h>
+#include <memory.h>
+#include <printk.h>
+#include <string.h>
+#include <x86.h>
+
+
+#define FXSAVE_SIZE          512
+#define FXSAVE_FCW           0                     /* x87 control word */
+#define FXSAVE_MXCSR         24                   /* SSE control/status */
+
+#define FCW_DEFAULT          0x037f             /* all exceptions masked */
+#define MXCSR_DEFAULT        0x1f80             /* all exceptions masked */
+
+#define FPU_NO_CPU           0xff       /* state not loaded on any cpu */
+
+
+extern __attribute__((noreturn)) void die(void);
+
+static uint64_t  fpu_xcr0;               /* components saved, XSAVE only */
+static size_t    fpu_size = FXSAVE_SIZE;    /* bytes of a task state area */
+static bool_t    fpu_xsave;
+static bool_t    fpu_xsaveopt;
+
+
+static void save_state(struct task *task)
+{
+	uint32_t lo = (uint32_t) fpu_xcr0, hi = (uint32_t) (fpu_xcr0 >> 32);
+	void *area = (void *) task->fpu;
+
+	if (fpu_xsaveopt)
+		asm volatile ("xsaveopt64 %0" : "+m" (*(uint8_t (*)[]) area)
+			      : "a" (lo), "d" (hi));
+	else if (fpu_xsave)
+		asm volatile ("xsave64 %0" : "+m" (*(uint8_t (*)[]) area)
+			      : "a" (lo), "d" (hi));
+	else
+		asm volatile ("fxsave64 %0" : "+m" (*(uint8_t (*)[]) area));
+}
+
+static void restore_state(struct task *task)
+{
+	uint32_t lo = (uint32_t) fpu_xcr0, hi = (uint32_t) (fpu_xcr0 >> 32);
+	void *area = (void *) task->fpu;
+
+	if (fpu_xsave)
+		asm volatile ("xrstor64 %0" : : "m" (*(uint8_t (*)[]) area),
+			      "a" (lo), "d" (hi));
+	else
+		asm volatile ("fxrstor64 %0" : : "m" (*(uint8_t (*)[]) area));
+}
+
+/*
+ * A zeroed XSAVE area has an empty XSTATE_BV: XRSTOR puts every component
+ * in its initial state, but MXCSR which is always read. FXRSTOR reads the
+ * whole area, hence the control words.
+ */
+static paddr_t alloc_state(void)
+{
+	paddr_t area = alloc_zeroed_page();
+
+	if (area == 0)
+		return 0;
+
+	*(uint16_t *) (area + FXSAVE_FCW) = FCW_DEFAULT;
+	*(uint32_t *) (area + FXSAVE_MXCSR) = MXCSR_DEFAULT;
+	return area;
+}
+
+/*
+ * Device not available: the running task touched the x87/SSE/AVX
+ * registers while CR0.TS is set. This is the first use since it got the
+ * cpu, load its state (allocated on the very first use).
+ */
+static void fpu_trap(struct interrupt_context *ctx)
+{
+	struct cpu *cpu = this_cpu();
+	struct task *task = cpu->running;
+
+	if ((ctx->cs & 3) != 3 || task == NULL) {
+		printk("[error] fpu: #NM in kernel at %p\n", ctx->rip);
+		die();
+	}
+
+	if (task->fpu == 0) {
+		task->fpu = alloc_state();
+		if (task->fpu == 0) {
+			printk("[error] fpu: cannot allocate state area\n");
+			exit_task();
+			return;
+		}
+	}
+
+	clts();
+	restore_state(task);
+	cpu->fpu_owner = task;
+	cpu->fpu_active = 1;
+	task->fpu_cpu = cpu->id;
+	task->fpu_restores++;
+}
+
+void setup_fpu(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	load_cr0((store_cr0() & ~CR0_EM) | CR0_MP | CR0_TS);
+	load_cr4(store_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if (ecx & CPUID1_ECX_XSAVE) {
+		load_cr4(store_cr4() | CR4_OSXSAVE);
+
+		fpu_xcr0 = XCR0_X87 | XCR0_SSE;
+		if (ecx & CPUID1_ECX_AVX)
+			fpu_xcr0 |= XCR0_AVX;
+		xsetbv(0, fpu_xcr0);
+
+		/* EBX: size needed by the components enabled in XCR0 */
+		cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+		fpu_size = ebx;
+		cpuid(0xd, 1, &eax, &ebx, &ecx, &edx);
+		fpu_xsaveopt = !!(eax & CPUIDD1_EAX_XSAVEOPT);
+		fpu_xsave = 1;
+	}
+
+	if (fpu_size > 0x1000) {
+		printk("[error] fpu: %lu bytes state area\n", fpu_size);
+		die();
+	}
+
+	interrupt_vector[INT_NM] = fpu_trap;
+}
+
+/*
+ * Eager save, lazy restore. The state of prev goes to memory if it had
+ * the registers, so that it can run anywhere. They stay loaded though: if
+ * next owns them and nothing else was restored on this cpu since, it gets
+ * the cpu without a trap.
+ */
+void fpu_switch(struct cpu *cpu, struct task *prev, struct task *next)
+{
+	if (cpu->fpu_active && prev != NULL && prev != cpu->dead)
+		save_state(prev);
+
+	if (next != NULL && next == cpu->fpu_owner && next->fpu_cpu == cpu->id) {
+		if (!cpu->fpu_active)
+			clts();
+		cpu->fpu_active = 1;
+	} else {
+		if (cpu->fpu_active)
+			load_cr0(store_cr0() | CR0_TS);
+		cpu->fpu_active = 0;
+	}
+}
+
+int fpu_fork(struct task *child, struct task *parent)
+{
+	struct cpu *cpu = this_cpu();
+
+	child->fpu = 0;
+	child->fpu_cpu = FPU_NO_CPU;
+	child->fpu_restores = 0;
+
+	if (parent->fpu == 0)
+		return 0;
+
+	child->fpu = alloc_page();
+	if (child->fpu == 0)
+		return -1;
+
+	/* The registers may be newer than the area */
+	if (cpu->fpu_active && cpu->fpu_owner == parent)
+		save_state(parent);
+
+	memcpy((void *) child->fpu, (void *) parent->fpu, fpu_size);
+	return 0;
+}
+
+void fpu_release(struct task *task)
+{
+	size_t i;
+
+	for (i = 0; i < SMP_MAX_CPUS; i++)
+		if (cpus[i].fpu_owner == task)
+			cpus[i].fpu_owner = NULL;
+
+	if (task->fpu != 0)
+		free_page(task->fpu);
+}
@@ -1,6 +1,7 @@
 #include <idt.h>
 #include <types.h>
 #include <printk.h>
+#include <smp.h>
 #include <x86.h>
 
 
@@ -24,9 +25,20 @@
 #define LAPIC_TIMER_PERIODIC       (1u << 17)
 #define LAPIC_DISABLE              (1u << 16)
 #define LAPIC_SPURIOUS_ASE         (1u << 8)
+#define LAPIC_TIMER_DIVIDE_16      3
+#define LAPIC_ICR_PENDING          (1u << 12)
+
+#define PIT_FREQUENCY              1193182                             /* Hz */
+#define PIT_COMMAND_PORT           0x43
+#define PIT_CHANNEL2_PORT          0x42
+#define PIT_CHANNEL2_MODE0         0xb0       /* lobyte/hibyte, one-shot */
+#define PIT_GATE_PORT              0x61
+#define PIT_GATE_CHANNEL2          0x01
+#define PIT_GATE_SPEAKER           0x02
+#define PIT_GATE_OUT2              0x20
+#define CALIBRATION_MS             10
 
 #define INTERRUPT_GATE_TYPE        0xee00
-#define TRAP_GATE_TYPE             0xef00
 
 
 extern vaddr_t trap_vector[];
@@ -62,14 +74,28 @@ static void default_interrupt(struct interrupt_context *ctx)
 	asm volatile ("hlt");
 }
 
+/*
+ * Every handler runs with the big kernel lock, but TLB shootdowns: the
+ * processor asking for one holds the lock while it waits for the others.
+ */
 void trap(struct interrupt_context *ctx)
 {
 	interrupt_handler_t handler = interrupt_vector[ctx->itnum];
 
+	if (ctx->itnum == INT_USER_TLB) {
+		tlb_flush_request();
+		lapic_eoi();
+		return;
+	}
+
+	lock_kernel();
+
 	if (handler == NULL)
 		default_interrupt(ctx);
 	else
 		handler(ctx);
+
+	unlock_kernel();
 }
 
 
@@ -128,13 +154,18 @@ void setup_interrupts(void)
 		idt64[i].off2 = ((trap_vector[i] >> 32) & 0xffffffff);
 		idt64[i].sel = KERNEL_CODE_SELECTOR;
 
-		if (i == INT_USER_SYSCALL) {
-			idt64[i].flags = TRAP_GATE_TYPE;
-		} else {
-			idt64[i].flags = INTERRUPT_GATE_TYPE;
-		}
+		/*
+		 * INT_USER_SYSCALL too: the kernel lock and the scheduler
+		 * expect interrupts off, as SYSCALL leaves them (SFMASK).
+		 */
+		idt64[i].flags = INTERRUPT_GATE_TYPE;
 	}
 
+	load_interrupts();
+}
+
+void load_interrupts(void)
+{
 	asm volatile ("lidt idtr64");
 }
 
@@ -187,19 +218,82 @@ struct lapic
 
 struct lapic *lapic = (struct lapic *) LAPIC_VADDR;
 
+uint64_t tsc_khz;                  /* TSC cycles per ms, see calibrate_timer */
+static uint32_t timer_khz;     /* LAPIC timer ticks per ms, divided by 16 */
+
+
+void lapic_eoi(void)
+{
+	lapic->eoi.reg = 0;
+}
+
+uint8_t lapic_id(void)
+{
+	return lapic->id.reg >> 24;
+}
+
+void lapic_send(uint8_t apic_id, uint32_t icr)
+{
+	lapic->icr_high.reg = ((uint32_t) apic_id) << 24;
+	lapic->icr_low.reg = icr;
+
+	while (lapic->icr_low.reg & LAPIC_ICR_PENDING)
+		;
+}
 
 static void timer_interrupt(struct interrupt_context *ctx
 			    __attribute__ ((unused)))
 {
-	lapic->eoi.reg = 0;
+	lapic_eoi();
+}
+
+/*
+ * Measure the TSC and the LAPIC timer against the PIT channel 2, the only
+ * clock with a known frequency. Return the LAPIC timer ticks per ms (with
+ * the timer divided by 16) and set tsc_khz.
+ */
+static uint32_t calibrate_timer(void)
+{
+	uint32_t latch = PIT_FREQUENCY * CALIBRATION_MS / 1000;
+	uint64_t tsc;
+	uint32_t ticks;
+	uint8_t gate;
+
+	gate = in8(PIT_GATE_PORT) & ~(PIT_GATE_SPEAKER | PIT_GATE_CHANNEL2);
+	out8(PIT_GATE_PORT, gate);
+
+	out8(PIT_COMMAND_PORT, PIT_CHANNEL2_MODE0);
+	out8(PIT_CHANNEL2_PORT, latch & 0xff);
+	out8(PIT_CHANNEL2_PORT, latch >> 8);
+
+	lapic->timer_divide.reg = LAPIC_TIMER_DIVIDE_16;
+	lapic->timer_initial.reg = 0xffffffff;
+	tsc = rdtsc();
+
+	/* The count starts when the gate rises, OUT2 rises when it is done */
+	out8(PIT_GATE_PORT, gate | PIT_GATE_CHANNEL2);
+	while (!(in8(PIT_GATE_PORT) & PIT_GATE_OUT2))
+		;
+
+	ticks = 0xffffffff - lapic->timer_current.reg;
+	tsc = rdtsc() - tsc;
+	lapic->timer_initial.reg = 0;
+
+	tsc_khz = tsc / CALIBRATION_MS;
+	printk("[apic] TSC at %lu kHz, timer at %u ticks/ms\n", tsc_khz,
+	       ticks / CALIBRATION_MS);
+
+	return ticks / CALIBRATION_MS;
 }
 
+/*
+ * Setup the LAPIC of the calling processor. The bootstrap processor, first
+ * to come, also calibrates the timer for the others.
+ */
 void setup_apic(void)
 {
 	uint64_t val = rdmsr(LAPIC_BASE_MSR);
 
-	interrupt_vector[INT_USER_TIMER] = timer_interrupt;
-
 	wrmsr(LAPIC_BASE_MSR, val & ~LAPIC_BASE_ENABLE);
 
 	lapic->tpr.reg = 0;
@@ -211,11 +305,16 @@ void setup_apic(void)
 	lapic->local1_entry.reg = LAPIC_DISABLE;
 	lapic->error_entry.reg = LAPIC_DISABLE;
 
-	lapic->timer_entry.reg = INT_USER_TIMER | LAPIC_TIMER_PERIODIC;
-	lapic->timer_divide.reg = 3;                         /* divide by 16 */
-	lapic->timer_initial.reg = 0x1000;   /* by the power of black magic! */
-
 	wrmsr(LAPIC_BASE_MSR, val | LAPIC_BASE_ENABLE);
 
 	lapic->svr.reg |= (INT_USER_SPURIOUS | LAPIC_SPURIOUS_ASE);
+
+	if (timer_khz == 0) {
+		interrupt_vector[INT_USER_TIMER] = timer_interrupt;
+		timer_khz = calibrate_timer();
+	}
+
+	lapic->timer_entry.reg = INT_USER_TIMER | LAPIC_TIMER_PERIODIC;
+	lapic->timer_divide.reg = LAPIC_TIMER_DIVIDE_16;
+	lapic->timer_initial.reg = timer_khz * 1000 / TIMER_HZ;
 }
@@ -1,6 +1,8 @@
+#include <fpu.h>                               /* SIMD registers for tasks */
 #include <idt.h>                            /* see there for interrupt names */
 #include <memory.h>                               /* physical page allocator */
 #include <printk.h>                      /* provides printk() and snprintk() */
+#include <smp.h>                            /* start the other processors */
 #include <string.h>                                     /* provides memset() */
 #include <syscall.h>                         /* setup system calls for tasks */
 #include <task.h>                             /* load the task from mb2 info */
@@ -11,6 +13,8 @@
 __attribute__((noreturn))
 void die(void)
 {
+	log_defer(0);                      /* the last messages to the screen */
+
 	/* Stop fetching instructions and go low power mode */
 	asm volatile ("hlt");
 
@@ -23,15 +27,22 @@ __attribute__((noreturn))
 void main_multiboot2(void *mb2)
 {
 	clear();                                     /* clear the VGA screen */
+	setup_console(mb2_cmdline(mb2));       /* console=vga,serial option */
 	printk("Rackdoll OS\n-----------\n\n");                 /* greetings */
 
 	setup_interrupts();                           /* setup a 64-bits IDT */
 	setup_tss();                                  /* setup a 64-bits TSS */
+	setup_syscalls();                      /* SYSCALL/SYSRET entry point */
+	setup_fpu();                  /* lazy x87/SSE/AVX state, #NM handler */
+	setup_memory();                       /* setup the physical allocator */
 	interrupt_vector[INT_PF] = pgfault;      /* setup page fault handler */
 
 	remap_pic();               /* remap PIC to avoid spurious interrupts */
 	disable_pic();                         /* disable anoying legacy PIC */
+	setup_apic();                      /* periodic timer for preemption */
+	setup_smp();                   /* wake up the application processors */
 	sti();                                          /* enable interrupts */
+	log_defer(1);               /* now the timer flushes printk to screen */
 
 	/* Exercice 1 */
 	// uint64_t cr3 = store_cr3();
@@ -2,69 +2,636 @@
 #include "types.h"
 #include <memory.h>
 #include <printk.h>
+#include <smp.h>
 #include <string.h>
+#include <syscall.h>
 #include <x86.h>
 
-#define PHYSICAL_POOL_PAGES 64
+#define PHYSICAL_POOL_START 0x400000          /* see entry.S */
+#define PHYSICAL_POOL_PAGES 8192
 #define PHYSICAL_POOL_BYTES (PHYSICAL_POOL_PAGES << 12)
-#define BITSET_SIZE (PHYSICAL_POOL_PAGES >> 6)
 #define PGT_NR_ENTRIES	512
 #define PAGE_SIZE 0x1000
+#define HUGE_PAGE_ORDER 9
+#define HUGE_PAGE_SIZE (PAGE_SIZE << HUGE_PAGE_ORDER)
+#define FAULT_AROUND_PAGES 16  /* power of two, at most one PML1 (512) */
+#define TLB_FLUSH_THRESHOLD 32     /* pages unmapped before a full flush */
+#define PAGE_OPS_ROUNDS 64           /* runs of each page_ops variant */
+#define ZEROED_POOL_PAGES 256         /* pre-zeroed pages kept for faults */
+#define ZEROED_BATCH 16               /* pages zeroed per idle timer tick */
+
+/*
+ * Buddy allocator: a block of order k is made of 2^k contiguous pages and
+ * is aligned on its size. The largest blocks (order 9) are 2 MiB.
+ */
+#define NR_ORDERS FRAME_NR_ORDERS
+#define MAX_ORDER (NR_ORDERS - 1)
+#define ORDER_BLOCKS(order) (PHYSICAL_POOL_PAGES >> (order))
+#define ORDER_WORDS(order) ((ORDER_BLOCKS(order) + 63) >> 6)
+#define BITMAP_WORDS (((2 * PHYSICAL_POOL_PAGES) >> 6) + NR_ORDERS)
 
 extern __attribute__((noreturn)) void die(void);
 
-static uint64_t bitset[BITSET_SIZE];
+/* Free blocks are linked through their first bytes (identity mapped) */
+struct free_block
+{
+	struct free_block *next;
+	struct free_block *prev;
+};
+
+static struct free_block *free_list[NR_ORDERS];    /* free blocks per order */
+static size_t free_count[NR_ORDERS];             /* length of each free list */
+static uint64_t free_orders;           /* bit k set if free_list[k] not empty */
 
-static uint8_t pool[PHYSICAL_POOL_BYTES] __attribute__((aligned(0x1000)));
+/* One bit per block of each order, set when the block is free */
+static uint64_t bitmap[BITMAP_WORDS];
+static uint64_t *order_bitmap[NR_ORDERS];
 
-paddr_t alloc_page(void)
+static uint16_t refcount[PHYSICAL_POOL_PAGES];    /* references per pool page */
+
+static paddr_t kernel_pgt;                 /* boot page table, kernel only */
+
+/*
+ * Pages zeroed ahead of time by the idle loops. They stay allocated while
+ * in the pool, which is given back to the buddy allocator under pressure.
+ */
+static paddr_t zeroed_pool[ZEROED_POOL_PAGES];
+static size_t nr_zeroed;
+static uint64_t zeroed_hits;        /* alloc_zeroed_page() served from pool */
+static uint64_t zeroed_misses;             /* ... or zeroed on the spot */
+
+static size_t drain_zeroed_pages(void);
+static void check_cache_modes(void);
+static void free_pgt(paddr_t pml, uint8_t level, vaddr_t base);
+
+/*
+ * Process context identifiers: each address space gets its own tag so its
+ * TLB entries survive a CR3 switch. PCID 0 is the boot page table.
+ */
+#define NR_PCIDS 4096
+#define TLB_MISS_EVENT 0x0108  /* DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK */
+
+static int pcid_enabled;
+static int invpcid_enabled;
+static int tlb_counter_enabled;
+static uint64_t pcid_bitmap[NR_PCIDS >> 6] = { 1 };  /* PCID 0 is reserved */
+
+/*
+ * Task images are mapped straight from the multiboot modules: these frames
+ * are not owned by the pool and are never reference counted nor released.
+ */
+static int is_pool_page(paddr_t addr)
+{
+	return addr >= PHYSICAL_POOL_START
+		&& addr < PHYSICAL_POOL_START + PHYSICAL_POOL_BYTES;
+}
+
+static size_t pool_index(paddr_t addr)
+{
+	return (addr - PHYSICAL_POOL_START) >> 12;
+}
+
+static paddr_t pool_addr(size_t index)
+{
+	return PHYSICAL_POOL_START + (index << 12);
+}
+
+static int test_block(uint8_t order, size_t index)
+{
+	size_t b = index >> order;
+
+	return !!(order_bitmap[order][b >> 6] & (1ul << (b & 63)));
+}
+
+static void push_block(uint8_t order, size_t index)
+{
+	struct free_block *block = (struct free_block *)pool_addr(index);
+	size_t b = index >> order;
+
+	block->prev = NULL;
+	block->next = free_list[order];
+	if (block->next != NULL)
+		block->next->prev = block;
+	free_list[order] = block;
+
+	order_bitmap[order][b >> 6] |= 1ul << (b & 63);
+	free_count[order]++;
+	free_orders |= 1ul << order;
+}
+
+static void remove_block(uint8_t order, size_t index)
+{
+	struct free_block *block = (struct free_block *)pool_addr(index);
+	size_t b = index >> order;
+
+	if (block->prev != NULL)
+		block->prev->next = block->next;
+	else
+		free_list[order] = block->next;
+	if (block->next != NULL)
+		block->next->prev = block->prev;
+
+	order_bitmap[order][b >> 6] &= ~(1ul << (b & 63));
+	if (--free_count[order] == 0)
+		free_orders &= ~(1ul << order);
+}
+
+/*
+ * Entries 0 to 3 of the PAT are selected by the PWT and PCD bits of the
+ * entries (entry.S and PTE_CACHE_*): write-back, write-combining, UC- and
+ * uncacheable. Every processor must use the same PAT, and no stale line or
+ * translation may survive the change.
+ */
+static void setup_pat(void)
+{
+	uint64_t cr4 = store_cr4();
+
+	wrmsr(MSR_PAT, PAT_ENTRY(0, PAT_WB) | PAT_ENTRY(1, PAT_WC)
+	      | PAT_ENTRY(2, PAT_UC_MINUS) | PAT_ENTRY(3, PAT_UC)
+	      | PAT_ENTRY(4, PAT_WB) | PAT_ENTRY(5, PAT_WT)
+	      | PAT_ENTRY(6, PAT_UC_MINUS) | PAT_ENTRY(7, PAT_UC));
+	wbinvd();
+	load_cr4(cr4 & ~CR4_PGE);
+	load_cr4(cr4);
+}
+
+void setup_tlb(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	setup_pat();
+
+	/* Kernel mappings are global, see entry.S */
+	load_cr4(store_cr4() | CR4_PGE);
+
+	cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	if (ecx & CPUID1_ECX_PCID) {
+		load_cr4(store_cr4() | CR4_PCIDE);
+		pcid_enabled = 1;
+
+		cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+		invpcid_enabled = !!(ebx & CPUID7_EBX_INVPCID);
+	}
+
+	/* Count the TLB misses with the first general purpose counter */
+	cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+	if (eax < 0xa)
+		return;
+	cpuid(0xa, 0, &eax, &ebx, &ecx, &edx);
+	if ((eax & 0xff) == 0 || ((eax >> 8) & 0xff) == 0)
+		return;
+
+	wrmsr(MSR_PERFEVTSEL0, 0);
+	wrmsr(MSR_PMC0, 0);
+	wrmsr(MSR_PERFEVTSEL0, TLB_MISS_EVENT | PERFEVTSEL_USR | PERFEVTSEL_OS
+	      | PERFEVTSEL_EN);
+	if ((eax & 0xff) >= 2)
+		wrmsr(MSR_PERF_GLOBAL_CTRL, rdmsr(MSR_PERF_GLOBAL_CTRL) | 1);
+	tlb_counter_enabled = 1;
+}
+
+static paddr_t active_pgt(void)
+{
+	return PTE_NEXT_ADDR(store_cr3());
+}
+
+static void alloc_pcid(struct task *ctx)
 {
-	size_t i, j;
-	uint64_t v;
+	size_t i;
+
+	ctx->pcid = 0;
+	ctx->tlb_stale = ~0u;   /* the PCID may still tag a dead address space */
+
+	if (!pcid_enabled)
+		return;
 
-	for (i = 0; i < BITSET_SIZE; i++) {
-		if (bitset[i] == 0xffffffffffffffff)
+	for (i = 0; i < (NR_PCIDS >> 6); i++) {
+		if (pcid_bitmap[i] == 0xffffffffffffffff)
 			continue;
+		ctx->pcid = (i << 6) + __builtin_ctzll(~pcid_bitmap[i]);
+		pcid_bitmap[i] |= 1ul << (ctx->pcid & 63);
+		return;
+	}
+}
+
+static void free_pcid(struct task *ctx)
+{
+	if (ctx->pcid != 0)
+		pcid_bitmap[ctx->pcid >> 6] &= ~(1ul << (ctx->pcid & 63));
+	ctx->pcid = 0;
+}
+
+/*
+ * Page clearing and copying variants. Which one is the fastest depends on
+ * the processor (ERMS, store bandwidth...): setup_page_ops() times them at
+ * boot and keeps the best of each kind.
+ */
+static void clear_page_stosq(paddr_t addr)
+{
+	void *dst = (void *)addr;
+	size_t n = PAGE_SIZE / 8;
+
+	asm volatile ("rep stosq" : "+D" (dst), "+c" (n) : "a" (0ul)
+		      : "memory");
+}
+
+static void clear_page_stosb(paddr_t addr)
+{
+	void *dst = (void *)addr;
+	size_t n = PAGE_SIZE;
+
+	asm volatile ("rep stosb" : "+D" (dst), "+c" (n) : "a" (0ul)
+		      : "memory");
+}
+
+/*
+ * Plain stores, 4 per iteration. The empty asm keeps the compiler from
+ * turning the loop back into a string instruction or a memset call.
+ */
+static void clear_page_loop(paddr_t addr)
+{
+	uint64_t *dst = (uint64_t *)addr;
+	size_t i;
+
+	for (i = 0; i < PAGE_SIZE / 8; i += 4) {
+		dst[i] = 0;
+		dst[i + 1] = 0;
+		dst[i + 2] = 0;
+		dst[i + 3] = 0;
+		asm volatile ("" : : : "memory");
+	}
+}
+
+static void copy_page_movsq(paddr_t dst, paddr_t src)
+{
+	void *d = (void *)dst;
+	const void *s = (const void *)src;
+	size_t n = PAGE_SIZE / 8;
+
+	asm volatile ("rep movsq" : "+D" (d), "+S" (s), "+c" (n) : : "memory");
+}
+
+static void copy_page_movsb(paddr_t dst, paddr_t src)
+{
+	void *d = (void *)dst;
+	const void *s = (const void *)src;
+	size_t n = PAGE_SIZE;
+
+	asm volatile ("rep movsb" : "+D" (d), "+S" (s), "+c" (n) : : "memory");
+}
 
-		for (j = 0; j < 64; j++) {
-			v = 1ul << j;
-			if (bitset[i] & v)
-				continue;
+static void copy_page_loop(paddr_t dst, paddr_t src)
+{
+	uint64_t *d = (uint64_t *)dst;
+	const uint64_t *s = (const uint64_t *)src;
+	size_t i;
+
+	for (i = 0; i < PAGE_SIZE / 8; i += 4) {
+		d[i] = s[i];
+		d[i + 1] = s[i + 1];
+		d[i + 2] = s[i + 2];
+		d[i + 3] = s[i + 3];
+		asm volatile ("" : : : "memory");
+	}
+}
+
+static const struct
+{
+	const char  *name;
+	void       (*fn)(paddr_t);
+} clear_variants[] = {
+	{ "rep stosq", clear_page_stosq },
+	{ "rep stosb", clear_page_stosb },
+	{ "loop",      clear_page_loop  }
+};
+
+static const struct
+{
+	const char  *name;
+	void       (*fn)(paddr_t, paddr_t);
+} copy_variants[] = {
+	{ "rep movsq", copy_page_movsq },
+	{ "rep movsb", copy_page_movsb },
+	{ "loop",      copy_page_loop  }
+};
+
+static void (*clear_page_fn)(paddr_t) = clear_page_stosq;
+static void (*copy_page_fn)(paddr_t, paddr_t) = copy_page_movsq;
+
+/* Lowest time of PAGE_OPS_ROUNDS runs, the first one warms the caches */
+static uint64_t time_page_op(void (*clear)(paddr_t),
+			     void (*copy)(paddr_t, paddr_t),
+			     paddr_t dst, paddr_t src)
+{
+	uint64_t start, t, best = ~0ul;
+	size_t i;
+
+	for (i = 0; i <= PAGE_OPS_ROUNDS; i++) {
+		start = rdtsc();
+		if (clear != NULL)
+			clear(dst);
+		else
+			copy(dst, src);
+		t = rdtsc() - start;
+		if (i > 0 && t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+static void setup_page_ops(void)
+{
+	paddr_t dst = alloc_page(), src = alloc_page();
+	uint64_t t, best;
+	size_t i, pick;
+
+	if (dst == 0 || src == 0)
+		goto out;
+
+	best = ~0ul;
+	for (i = pick = 0; i < sizeof (clear_variants) /
+		     sizeof (clear_variants[0]); i++) {
+		t = time_page_op(clear_variants[i].fn, NULL, dst, src);
+		if (t < best) {
+			best = t;
+			pick = i;
+		}
+	}
+	clear_page_fn = clear_variants[pick].fn;
+	printk("[memory] clear_page: %s (%lu cycles)\n",
+	       clear_variants[pick].name, best);
 
-			bitset[i] |= v;
-			return (((64 * i) + j) << 12) + ((paddr_t)&pool);
+	best = ~0ul;
+	for (i = pick = 0; i < sizeof (copy_variants) /
+		     sizeof (copy_variants[0]); i++) {
+		t = time_page_op(NULL, copy_variants[i].fn, dst, src);
+		if (t < best) {
+			best = t;
+			pick = i;
 		}
 	}
+	copy_page_fn = copy_variants[pick].fn;
+	printk("[memory] copy_page: %s (%lu cycles)\n",
+	       copy_variants[pick].name, best);
+
+ out:
+	free_page(dst);
+	free_page(src);
+}
+
+void clear_page(paddr_t addr)
+{
+	clear_page_fn(addr);
+}
+
+void copy_page(paddr_t dst, paddr_t src)
+{
+	copy_page_fn(dst, src);
+}
+
+void clear_pages(paddr_t addr, uint8_t order)
+{
+	size_t i;
+
+	for (i = 0; i < (1ul << order); i++)
+		clear_page_fn(addr + i * PAGE_SIZE);
+}
+
+void copy_pages(paddr_t dst, paddr_t src, uint8_t order)
+{
+	size_t i;
+
+	for (i = 0; i < (1ul << order); i++)
+		copy_page_fn(dst + i * PAGE_SIZE, src + i * PAGE_SIZE);
+}
+
+void setup_memory(void)
+{
+	size_t off = 0, i;
+
+	kernel_pgt = store_cr3();
+	setup_tlb();
+
+	for (i = 0; i < NR_ORDERS; i++) {
+		order_bitmap[i] = bitmap + off;
+		off += ORDER_WORDS(i);
+	}
+
+	for (i = 0; i < PHYSICAL_POOL_PAGES; i += (1ul << MAX_ORDER))
+		push_block(MAX_ORDER, i);
+
+	setup_page_ops();
+	check_cache_modes();
+}
+
+paddr_t alloc_pages(uint8_t order)
+{
+	uint64_t avail;
+	uint8_t k;
+	size_t index;
+
+	if (order > MAX_ORDER) {
+		printk("[error] alloc_pages: invalid order %u\n", order);
+		return 0;
+	}
+
+	/* Smallest non empty order which can satisfy the request */
+	avail = free_orders & ~((1ul << order) - 1);
+	if (avail == 0)
+		goto err;
+
+	k = __builtin_ctzll(avail);
+	index = pool_index((paddr_t)free_list[k]);
+	remove_block(k, index);
+
+	/* Split the block, giving back the upper halves */
+	while (k > order) {
+		k--;
+		push_block(k, index + (1ul << k));
+	}
 
+	refcount[index] = 1;
+	return pool_addr(index);
+ err:
+	if (drain_zeroed_pages() > 0)
+		return alloc_pages(order);
 	printk("[error] Not enough identity free page\n");
 	return 0;
 }
 
-void free_page(paddr_t addr)
+void free_pages(paddr_t addr, uint8_t order)
 {
-	paddr_t tmp = addr;
-	size_t i, j;
-	uint64_t v;
+	size_t index, buddy;
 
-	tmp = tmp - ((paddr_t)&pool);
-	tmp = tmp >> 12;
+	if (!is_pool_page(addr))
+		return;
 
-	i = tmp / 64;
-	j = tmp % 64;
-	v = 1ul << j;
+	index = pool_index(addr);
 
-	if ((bitset[i] & v) == 0) {
+	if (refcount[index] == 0 || test_block(order, index)) {
 		printk("[error] Invalid page free %p\n", addr);
 		die();
 	}
 
-	bitset[i] &= ~v;
+	if (--refcount[index] > 0)
+		return;
+
+	/* Merge with the buddy as long as it is free */
+	while (order < MAX_ORDER) {
+		buddy = index ^ (1ul << order);
+		if (!test_block(order, buddy))
+			break;
+		remove_block(order, buddy);
+		index &= ~(1ul << order);
+		order++;
+	}
+
+	push_block(order, index);
+}
+
+paddr_t alloc_page(void)
+{
+	return alloc_pages(0);
+}
+
+void free_page(paddr_t addr)
+{
+	free_pages(addr, 0);
+}
+
+paddr_t alloc_zeroed_page(void)
+{
+	paddr_t addr;
+
+	if (nr_zeroed > 0) {
+		zeroed_hits++;
+		return zeroed_pool[--nr_zeroed];
+	}
+
+	addr = alloc_page();
+	if (addr != 0) {
+		zeroed_misses++;
+		clear_page(addr);
+	}
+	return addr;
+}
+
+/*
+ * Called on the timer ticks of idle processors, with the kernel lock held:
+ * zero a batch of pages and return how many were added.
+ */
+size_t refill_zeroed_pages(void)
+{
+	paddr_t addr;
+	size_t done = 0;
+
+	while (done < ZEROED_BATCH && nr_zeroed < ZEROED_POOL_PAGES
+	       && free_orders != 0) {
+		addr = alloc_page();
+		if (addr == 0)
+			break;
+		clear_page(addr);
+		zeroed_pool[nr_zeroed++] = addr;
+		done++;
+	}
+
+	return done;
+}
+
+static size_t drain_zeroed_pages(void)
+{
+	size_t done = nr_zeroed;
+
+	while (nr_zeroed > 0)
+		free_page(zeroed_pool[--nr_zeroed]);
+
+	return done;
+}
+
+void split_pages(paddr_t addr, uint8_t order)
+{
+	size_t index, i;
+
+	if (!is_pool_page(addr))
+		return;
+
+	/* Every page of the block now carries the references of the block */
+	index = pool_index(addr);
+	for (i = 1; i < (1ul << order); i++)
+		refcount[index + i] = refcount[index];
+}
+
+void ref_page(paddr_t addr)
+{
+	if (!is_pool_page(addr))
+		return;
+
+	refcount[pool_index(addr)]++;
+}
+
+size_t page_refs(paddr_t addr)
+{
+	if (!is_pool_page(addr))
+		return 0;
+
+	return refcount[pool_index(addr)];
+}
+
+void get_frame_stats(struct frame_stats *st)
+{
+	size_t largest = 0;
+	uint8_t k;
+
+	memset(st, 0, sizeof (*st));
+	st->total_pages = PHYSICAL_POOL_PAGES;
+
+	for (k = 0; k < NR_ORDERS; k++) {
+		st->free_blocks[k] = free_count[k];
+		st->free_pages += free_count[k] << k;
+	}
+
+	if (free_orders != 0) {
+		st->largest_order = 63 - __builtin_clzll(free_orders);
+		largest = free_count[st->largest_order] << st->largest_order;
+	}
+
+	/* Part of the free memory which is not in blocks of the largest order */
+	if (st->free_pages != 0)
+		st->fragmentation = 100 - (100 * largest) / st->free_pages;
+
+	st->zeroed_pages = nr_zeroed;
+	st->zeroed_hits = zeroed_hits;
+	st->zeroed_misses = zeroed_misses;
+}
+
+void print_frame_stats(void)
+{
+	struct frame_stats st;
+	uint8_t k;
+
+	get_frame_stats(&st);
+
+	printk("frames: %lu/%lu free, largest order %u, fragmentation %lu%%\n",
+	       st.free_pages, st.total_pages, st.largest_order,
+	       st.fragmentation);
+	for (k = 0; k < NR_ORDERS; k++)
+		printk("  order %u: %lu free block(s)\n", k, st.free_blocks[k]);
+	printk("  zeroed pool: %lu page(s), %lu hit(s), %lu miss(es)\n",
+	       st.zeroed_pages, st.zeroed_hits, st.zeroed_misses);
 }
 
 
 
 #define USER_STACK_START 0x2000000000
 #define USER_STACK_END 0x40000000
+#define USER_END 0x800000000000           /* lower canonical half ends */
+
+#define SHM_MAX_REGIONS 16
+
+#define PGFAULT_PRESENT 0x1          /* error code: protection violation */
+#define PGFAULT_WRITE   0x2           /* error code: fault on write access */
+#define PGFAULT_USER    0x4               /* error code: fault in user mode */
 /*
  * Memory model for Rackdoll OS
  *
@@ -82,6 +649,12 @@ void free_page(paddr_t addr)
  * +----------------------+ 0x40000000 1GiB
  * | Kernel               |
  * | (valloc)             |
+ * +----------------------+ 0x2400000 36 MiB
+ * | Kernel               |
+ * | (frame pool)         |
+ * +----------------------+ 0x400000  4 MiB
+ * | Kernel               |
+ * | (valloc)             |
  * +----------------------+ 0x201000  ~ +2 MiB
  * | Kernel               |
  * | (APIC)               |
@@ -94,9 +667,11 @@ void free_page(paddr_t addr)
  * +----------------------+ 0x0
  *
  * This is the memory model for Rackdoll OS: the kernel is located in low
- * addresses. The first 2 MiB are identity mapped and not cached.
+ * addresses. The first 2 MiB are identity mapped write-back, except the VGA
+ * memory (write-combining) and the BIOS ROMs (uncached).
  * Between 2 MiB and 1 GiB, there are kernel addresses which are not mapped
- * with an identity table.
+ * with an identity table, except the physical frame pool (4 MiB to 36 MiB)
+ * which is identity mapped with 2 MiB pages.
  * Between 1 GiB and 128 GiB is the stack addresses for user processes growing
  * down from 128 GiB.
  * The user processes expect these addresses are always available and that
@@ -140,15 +715,18 @@ void print_pgt(paddr_t pml, uint8_t level)
 }
 
 /*
-*/
-void map_page(struct task *ctx, vaddr_t vaddr, paddr_t paddr)
+ * Walk the page table of ctx down to the given level (1 for a 4 KiB page,
+ * 2 for a 2 MiB page), allocating the missing tables on the way.
+ * Return the entry for vaddr at that level, or NULL if a huge page already
+ * covers vaddr or if no table could be allocated.
+ */
+static paddr_t *walk_pgt(struct task *ctx, vaddr_t vaddr, uint8_t leaf)
 {
-	
 	paddr_t *pgt_addr = (paddr_t *)ctx->pgt;
 	paddr_t current_index;
 
 	/* Pour tous les lvl intermediaires */
-	for(uint8_t level = 4; level > 1; level--) {
+	for(uint8_t level = 4; level > leaf; level--) {
 		/* Calcul de l'index pour la pml courrante */
 		current_index = PTE_GET_INDEX_FOR_LVL(vaddr, level);
 
@@ -158,123 +736,1044 @@ void map_page(struct task *ctx, vaddr_t vaddr, paddr_t paddr)
 		 * - Soit on est en pml1 : on mappe la page physique demandee
 		*/
 		if (!PTE_IS_VALID(pgt_addr[current_index])) {
-			paddr_t new_page = alloc_page();
-			memset((void *)new_page, 0, PAGE_SIZE);
+			paddr_t new_page = alloc_zeroed_page();
+			if (new_page == 0)
+				return NULL;
 			pgt_addr[current_index] = new_page | PTE_FLAG_VALID | PTE_FLAG_USER | PTE_FLAG_RW;
+		} else if (PTE_IS_HUGE(pgt_addr[current_index])) {
+			return NULL;
 		}
 
 		/* On descend d'un niveau : risque de segfault ou pas ?*/
 		pgt_addr = (paddr_t *)PTE_NEXT_ADDR(pgt_addr[current_index]);	
 	}
 
-	current_index = PTE_GET_INDEX_PML1(vaddr);
-	if (!PTE_IS_VALID(pgt_addr[current_index])) {
-		pgt_addr[current_index] = paddr | PTE_FLAG_VALID | PTE_FLAG_USER | PTE_FLAG_RW;
-	} else {
+	return &pgt_addr[PTE_GET_INDEX_FOR_LVL(vaddr, leaf)];
+}
+
+static int install_pte(struct task *ctx, vaddr_t vaddr, paddr_t paddr,
+		       uint8_t leaf, paddr_t flags)
+{
+	paddr_t *pte = walk_pgt(ctx, vaddr, leaf);
+
+	if (pte == NULL || PTE_IS_VALID(*pte))
+		return -1;
+
+	*pte = paddr | flags;
+	return 0;
+}
+
+void map_page(struct task *ctx, vaddr_t vaddr, paddr_t paddr)
+{
+	paddr_t flags = PTE_FLAG_VALID | PTE_FLAG_USER | PTE_FLAG_RW;
+
+	/* Kernel tables are shared by all tasks: keep them in the TLB */
+	if (vaddr < USER_STACK_END)
+		flags = PTE_FLAG_VALID | PTE_FLAG_RW | PTE_FLAG_GLOBAL;
+
+	if (install_pte(ctx, vaddr, paddr, 1, flags) != 0) {
 		printk("[warning] map_page: vaddr %p is already mapped\n", vaddr);
 		asm volatile ("hlt");
 	}
 }
 
-void load_task(struct task *ctx)
+int map_huge_page(struct task *ctx, vaddr_t vaddr, paddr_t paddr)
+{
+	/* Only an empty PML2 entry can become a 2 MiB leaf */
+	return install_pte(ctx, vaddr, paddr, 2, PTE_FLAG_VALID | PTE_FLAG_USER
+			   | PTE_FLAG_RW | PTE_FLAG_HUGE);
+}
+
+static int is_huge_aligned(vaddr_t vaddr)
+{
+	return (vaddr & (HUGE_PAGE_SIZE - 1)) == 0;
+}
+
+/*
+ * Map [vaddr, end) with freshly allocated zeroed frames. With huge set,
+ * 2 MiB pages are used where the range covers a whole aligned 2 MiB chunk.
+ * The tables are walked once per PML1, not once per page.
+ */
+static void map_zeroed(struct task *ctx, vaddr_t vaddr, vaddr_t end, int huge)
+{
+	paddr_t *pte = NULL;
+	paddr_t new_page;
+
+	while (vaddr < end) {
+		if (huge && is_huge_aligned(vaddr)
+		    && end - vaddr >= HUGE_PAGE_SIZE) {
+			new_page = alloc_pages(HUGE_PAGE_ORDER);
+			if (new_page != 0) {
+				clear_pages(new_page, HUGE_PAGE_ORDER);
+				if (map_huge_page(ctx, vaddr, new_page) == 0) {
+					vaddr += HUGE_PAGE_SIZE;
+					pte = NULL;
+					continue;
+				}
+				free_pages(new_page, HUGE_PAGE_ORDER);
+			}
+		}
+
+		/* Nouvelle PML1 seulement quand on change de table */
+		if (pte == NULL || PTE_GET_INDEX_PML1(vaddr) == 0)
+			pte = walk_pgt(ctx, vaddr, 1);
+		else
+			pte++;
+
+		if (pte == NULL || PTE_IS_VALID(*pte)) {
+			printk("[warning] map_zeroed: vaddr %p is already mapped\n",
+			       vaddr);
+			pte = NULL;
+			vaddr += PAGE_SIZE;
+			continue;
+		}
+
+		new_page = alloc_zeroed_page();
+		if (new_page == 0)
+			return;
+		*pte = new_page | PTE_FLAG_VALID | PTE_FLAG_USER | PTE_FLAG_RW;
+		vaddr += PAGE_SIZE;
+	}
+}
+
+int load_task(struct task *ctx)
 {
 	/* On se trouve dans une nouvelle tache, il faut allouer pgt */
-	paddr_t new_pml4 = alloc_page();
-	memset((void *)new_pml4, 0, PAGE_SIZE);
+	paddr_t new_pml4 = alloc_zeroed_page();
+	if (new_pml4 == 0)
+		return -1;
 	ctx->pgt = new_pml4;
+	alloc_pcid(ctx);
 
 	/* Pour mapper noyau, on a besoin de creer pml3
 	 * car on a juste de copier pml3[0] du parent
 	 * TODO check user
 	*/
-	paddr_t pml3 = alloc_page();
-	memset((void *)pml3, 0, PAGE_SIZE);
+	paddr_t pml3 = alloc_zeroed_page();
+	if (pml3 == 0) {
+		free_page(new_pml4);
+		free_pcid(ctx);
+		ctx->pgt = 0;
+		return -1;
+	}
 	((paddr_t *)new_pml4)[0] = (paddr_t)pml3 | PTE_FLAG_VALID | PTE_FLAG_USER | PTE_FLAG_RW;
 
 	/* A partir de la, on a new_pml4[0] -> new_pml3[0], 
 	 * on peut copier la pml2 du kernel.
 	*/
-	/* On recupere la pgt du processus courrant */
-	paddr_t *kernel_pml4 = (paddr_t *)store_cr3();
+	/* On recupere la pgt du noyau */
+	paddr_t *kernel_pml4 = (paddr_t *)kernel_pgt;
 	paddr_t *kernel_pml3 = (paddr_t *)PTE_NEXT_ADDR(kernel_pml4[0]);
 	((paddr_t *)pml3)[0] = kernel_pml3[0];
 
-	/* La partie setup pgt est terminee, il faut maintenant
-	 * allouer.
-	*/
+	/*
+	 * La partie setup pgt est terminee. Rien n'est mappe ici : l'image,
+	 * la bss et la pile sont decrites par des zones et chargees a la
+	 * premiere faute de page.
+	 */
+	vaddr_t image_end = ctx->load_vaddr
+		+ (ctx->load_end_paddr - ctx->load_paddr);
 
-	/* On itere sur toutes la partie load_end_paddr - load_paddr */
-	vaddr_t vaddr = ctx->load_vaddr;
-	paddr_t paddr = ctx->load_paddr;
+	init_vmas(ctx);
+	add_vma(ctx, ctx->load_vaddr, image_end, VMA_IMAGE,
+		VMA_READ | VMA_WRITE | VMA_EXEC, ctx->load_paddr);
+	add_vma(ctx, image_end, ctx->bss_end_vaddr, VMA_ANONYMOUS,
+		VMA_READ | VMA_WRITE, 0);
+	add_vma(ctx, USER_STACK_END + PAGE_SIZE, USER_STACK_START,
+		VMA_ANONYMOUS, VMA_READ | VMA_WRITE, 0);
 
-	for(; paddr < ctx->load_end_paddr; paddr+=PAGE_SIZE) {
-		map_page(ctx, vaddr, paddr);
-		vaddr+=PAGE_SIZE;
+	/* La page de l'anneau est partagee avec le noyau, toujours presente */
+	ctx->ring = alloc_zeroed_page();
+	if (ctx->ring == 0)
+		goto err;
+	if (install_pte(ctx, SYSCALL_RING_VADDR, ctx->ring, 1, PTE_FLAG_VALID
+			| PTE_FLAG_USER | PTE_FLAG_RW | PTE_FLAG_SHARED) != 0) {
+		free_page(ctx->ring);
+		goto err;
 	}
-
-
-	printk("before bss alloc\n");
-	/* A ce moment, vaddr = bss_start */
-	for(; vaddr < ctx->bss_end_vaddr; vaddr+=PAGE_SIZE) {
-		paddr_t new_page = alloc_page();
-		memset((void *)new_page, 0, PAGE_SIZE);
-		map_page(ctx, vaddr, new_page);
-	}
-	
+	add_vma(ctx, SYSCALL_RING_VADDR, SYSCALL_RING_VADDR + PAGE_SIZE,
+		VMA_SHARED, VMA_READ | VMA_WRITE, 0);
 
 	printk("!!Task loaded: load_vaddr=%p, load_end_vaddr=%p, bss_end_vaddr=%p\n",
-		ctx->load_vaddr, vaddr,  ctx->bss_end_vaddr);
+		ctx->load_vaddr, image_end,  ctx->bss_end_vaddr);
+	return 0;
+ err:
+	printk("[error] load_task: no memory for the syscall ring\n");
+	ctx->ring = 0;
+	free_task(ctx);
+	return -1;
 }
 
+/* Charge the TLB misses since the last switch to the task leaving */
+static void charge_tlb_misses(struct cpu *cpu, struct task *next)
+{
+	uint64_t now;
+
+	if (!tlb_counter_enabled)
+		return;
+
+	now = rdmsr(MSR_PMC0);
+	if (cpu->tlb_owner != NULL)
+		cpu->tlb_owner->tlb_misses += now - cpu->tlb_last;
+	cpu->tlb_last = now;
+	cpu->tlb_owner = next;
+}
+
+/*
+ * A task only runs on one processor at a time: when it runs here, the
+ * entries the others kept in its PCID may become stale, so they flush them
+ * on their next load of the task.
+ */
 void set_task(struct task *ctx)
 {
-	load_cr3(ctx->pgt);
+	struct cpu *cpu = this_cpu();
+	uint64_t cr3 = ctx->pgt | ctx->pcid;
+	uint32_t me = 1u << cpu->id;
+
+	charge_tlb_misses(cpu, ctx);
+	ctx->switches++;
+
+	/* Keep the TLB entries tagged with the PCID if they are still valid */
+	if (pcid_enabled && ctx->pcid != 0 && !(ctx->tlb_stale & me))
+		cr3 |= CR3_NOFLUSH;
+	ctx->tlb_stale = ~me;
+
+	cpu->pgt = ctx->pgt;
+	load_cr3(cr3);
+}
+
+void unset_task(void)
+{
+	struct cpu *cpu = this_cpu();
+
+	charge_tlb_misses(cpu, NULL);
+	cpu->pgt = kernel_pgt;
+	load_cr3(kernel_pgt);
+}
+
+/*
+ * Mappings asked by a task must stay in the user half: below 1 GiB the
+ * page tables are the kernel ones, shared by every task.
+ */
+static int is_user_range(vaddr_t vaddr, size_t len)
+{
+	return len != 0 && vaddr >= USER_STACK_END && vaddr + len > vaddr
+		&& vaddr + len <= USER_END;
 }
 
-void mmap(struct task *ctx, vaddr_t vaddr)
+int mmap(struct task *ctx, vaddr_t vaddr)
 {
-	paddr_t new_page = alloc_page();
-	memset((void *)new_page, 0, PAGE_SIZE);
+	paddr_t new_page;
+
+	vaddr &= ~(PAGE_SIZE - 1);
+	if (!is_user_range(vaddr, PAGE_SIZE))
+		return -1;
+
+	if (add_vma(ctx, vaddr, vaddr + PAGE_SIZE, VMA_ANONYMOUS,
+		    VMA_READ | VMA_WRITE, 0) != 0)
+		return -1;
+
+	new_page = alloc_zeroed_page();
+	if (new_page == 0) {
+		remove_vmas(ctx, vaddr, vaddr + PAGE_SIZE);
+		return -1;
+	}
+
 	map_page(ctx, vaddr, new_page);
+	return 0;
 }
 
-void munmap(struct task *ctx, vaddr_t vaddr)
+int mmap_huge(struct task *ctx, vaddr_t vaddr, size_t len)
 {
-	paddr_t *pgt = (paddr_t *)ctx->pgt;
+	vaddr_t end;
 
-	/* On va jusqu'a PML1 */
-	for (uint8_t level = 4; level > 1; level--) {
-		uint16_t index = PTE_GET_INDEX_FOR_LVL(vaddr, level);
-		if (!PTE_IS_VALID(pgt[index])) {
-			printk("[warning] munmap: vaddr %p is not mapped\n", vaddr);
-			return;
+	if (!is_user_range(vaddr, len))
+		return -1;
+
+	end = (vaddr + len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	vaddr &= ~(PAGE_SIZE - 1);
+	if (add_vma(ctx, vaddr, end, VMA_ANONYMOUS, VMA_READ | VMA_WRITE,
+		    0) != 0)
+		return -1;
+
+	map_zeroed(ctx, vaddr, end, 1);
+	return 0;
+}
+
+int mmap_range(struct task *ctx, vaddr_t vaddr, size_t len)
+{
+	vaddr_t end;
+
+	if (!is_user_range(vaddr, len))
+		return -1;
+
+	/* Only declare the area, pages are zero filled on first access */
+	end = (vaddr + len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	return add_vma(ctx, vaddr & ~(PAGE_SIZE - 1), end, VMA_ANONYMOUS,
+		       VMA_READ | VMA_WRITE, 0);
+}
+
+/*
+ * Replace the 2 MiB leaf *pml2e by a PML1 table mapping the same frames
+ * with 4 KiB pages. A frame shared with another task is copied first so
+ * that its sub-pages can then be released one by one.
+ */
+static int demote_huge(paddr_t *pml2e, vaddr_t vaddr)
+{
+	paddr_t frame = PTE_NEXT_ADDR(*pml2e);
+	paddr_t flags = PTE_FLAGS(*pml2e) & ~PTE_FLAG_HUGE;
+	paddr_t copy, pml1;
+
+	pml1 = alloc_page();
+	if (pml1 == 0)
+		return -1;
+
+	if (page_refs(frame) > 1) {
+		copy = alloc_pages(HUGE_PAGE_ORDER);
+		if (copy == 0) {
+			free_page(pml1);
+			return -1;
+		}
+		copy_pages(copy, frame, HUGE_PAGE_ORDER);
+		free_pages(frame, HUGE_PAGE_ORDER);
+		frame = copy;
+		flags = (flags & ~PTE_FLAG_COW) | PTE_FLAG_RW;
+	}
+
+	split_pages(frame, HUGE_PAGE_ORDER);
+
+	for (uint16_t i = 0; i < PGT_NR_ENTRIES; i++)
+		((paddr_t *)pml1)[i] = (frame + i * PAGE_SIZE) | flags;
+
+	*pml2e = pml1 | PTE_FLAG_VALID | PTE_FLAG_USER | PTE_FLAG_RW;
+	invlpg(vaddr);
+
+	return 0;
+}
+
+static int pgt_is_empty(const paddr_t *pml)
+{
+	for (uint16_t i = 0; i < PGT_NR_ENTRIES; i++)
+		if (PTE_IS_VALID(pml[i]))
+			return 0;
+	return 1;
+}
+
+/*
+ * Unmap [vaddr, end), a range which does not cross a 2 MiB boundary, then
+ * release the tables which became empty (never the PML4).
+ * Return the number of pages unmapped, TLB invalidation is left to the
+ * caller.
+ */
+static size_t unmap_pml1(struct task *ctx, vaddr_t vaddr, vaddr_t end)
+{
+	paddr_t *pml[5];
+	uint16_t index[5];
+	uint16_t i, last = PTE_GET_INDEX_PML1(end - 1);
+	uint8_t level;
+	size_t done = 0;
+
+	/* On va jusqu'a PML2 en retenant le chemin */
+	pml[4] = (paddr_t *)ctx->pgt;
+	for (level = 4; level > 1; level--) {
+		index[level] = PTE_GET_INDEX_FOR_LVL(vaddr, level);
+		if (!PTE_IS_VALID(pml[level][index[level]]))
+			return 0;
+		pml[level - 1] = (paddr_t *)PTE_NEXT_ADDR(pml[level][index[level]]);
+	}
+
+	if (PTE_IS_HUGE(pml[2][index[2]])) {
+		/* Page de 2 MiB entierement demappee */
+		if (is_huge_aligned(vaddr) && end - vaddr == HUGE_PAGE_SIZE) {
+			free_pages(PTE_NEXT_ADDR(pml[2][index[2]]),
+				   HUGE_PAGE_ORDER);
+			pml[2][index[2]] = 0;
+			done = PGT_NR_ENTRIES;
+			goto collapse;
+		}
+
+		/* Partiellement demappee : elle redevient 4 KiB */
+		if (demote_huge(&pml[2][index[2]], vaddr) != 0) {
+			printk("[warning] munmap: cannot split %p\n", vaddr);
+			return 0;
+		}
+		pml[1] = (paddr_t *)PTE_NEXT_ADDR(pml[2][index[2]]);
+	}
+
+	for (i = PTE_GET_INDEX_PML1(vaddr); i <= last; i++) {
+		if (!PTE_IS_VALID(pml[1][i]))
+			continue;
+		free_page(PTE_NEXT_ADDR(pml[1][i]));
+		pml[1][i] = 0;
+		done++;
+	}
+
+	if (done == 0)
+		return 0;
+
+	if (!pgt_is_empty(pml[1]))
+		return done;
+	free_page((paddr_t)pml[1]);
+	pml[2][index[2]] = 0;
+
+ collapse:
+	/* Les tables devenues vides sont liberees, jamais la PML4 */
+	for (level = 2; level < 4; level++) {
+		if (!pgt_is_empty(pml[level]))
+			break;
+		free_page((paddr_t)pml[level]);
+		pml[level + 1][index[level + 1]] = 0;
+	}
+
+	return done;
+}
+
+size_t munmap_range(struct task *ctx, vaddr_t vaddr, size_t len)
+{
+	vaddr_t end = (vaddr + len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	vaddr_t start, next;
+	size_t done = 0;
+
+	vaddr &= ~(PAGE_SIZE - 1);
+	start = vaddr;
+
+	if (vaddr < USER_STACK_END) {
+		printk("[warning] munmap: vaddr %p is a kernel address\n", vaddr);
+		return 0;
+	}
+
+	/* The kernel keeps using the ring page until the task exits */
+	if (vaddr < SYSCALL_RING_VADDR + PAGE_SIZE && end > SYSCALL_RING_VADDR) {
+		printk("[warning] munmap: the syscall ring cannot be unmapped\n");
+		return 0;
+	}
+
+	/* An area left over the hole would fault fresh pages back in */
+	if (remove_vmas(ctx, vaddr, end) != 0) {
+		printk("[warning] munmap: no free area to split at %p\n", vaddr);
+		return 0;
+	}
+
+	while (vaddr < end) {
+		next = (vaddr + HUGE_PAGE_SIZE) & ~(HUGE_PAGE_SIZE - 1);
+		if (next > end)
+			next = end;
+		done += unmap_pml1(ctx, vaddr, next);
+		vaddr = next;
+	}
+
+	if (done == 0)
+		return 0;
+
+	if (active_pgt() == ctx->pgt) {
+		if (done > TLB_FLUSH_THRESHOLD) {
+			load_cr3(store_cr3());
+		} else {
+			for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE)
+				invlpg(vaddr);
+		}
+	} else if (pcid_enabled && ctx->pcid != 0) {
+		/* Entries of a sleeping task survive in its PCID */
+		if (!invpcid_enabled || done > TLB_FLUSH_THRESHOLD) {
+			ctx->tlb_stale = ~0u;
+		} else {
+			for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE)
+				invpcid(INVPCID_ADDRESS, ctx->pcid, vaddr);
+			ctx->tlb_stale |= ~(1u << this_cpu()->id);
 		}
-		pgt = (paddr_t *)PTE_NEXT_ADDR(pgt[index]);
 	}
 
-	// On est arrive a PML1
-	uint16_t index = PTE_GET_INDEX_PML1(vaddr);
-	if (!PTE_IS_VALID(pgt[index])) {
+	tlb_shootdown(ctx->pgt, start, end);
+
+	return done;
+}
+
+void munmap(struct task *ctx, vaddr_t vaddr)
+{
+	if (munmap_range(ctx, vaddr, PAGE_SIZE) == 0)
 		printk("[warning] munmap: vaddr %p is not mapped\n", vaddr);
-		return;
+}
+
+
+/*
+ * Named shared regions. Each one is a run of contiguous frames which keep
+ * one reference for the region itself, plus one per page table mapping
+ * them: a task exiting or unmapping a region only drops its own.
+ */
+struct shm_region
+{
+	char     name[SHM_NAME_MAX];
+	paddr_t  paddr;                               /* first frame */
+	size_t   size;                             /* bytes, page multiple */
+};
+
+static struct shm_region shm_regions[SHM_MAX_REGIONS];
+static size_t nr_shm_regions;
+
+/* Copy the user string name to buf, return -1 if empty or too long */
+static int shm_name(struct task *ctx, char *buf, vaddr_t name)
+{
+	int64_t len = strncpy_from_user(ctx, buf, name, SHM_NAME_MAX);
+
+	if (len <= 0 || len >= SHM_NAME_MAX)
+		return -1;
+	return 0;
+}
+
+static struct shm_region *find_shm(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nr_shm_regions; i++)
+		if (strcmp(shm_regions[i].name, name) == 0)
+			return shm_regions + i;
+
+	return NULL;
+}
+
+int64_t shm_create(struct task *ctx, vaddr_t name, size_t size)
+{
+	struct shm_region *region;
+	char buf[SHM_NAME_MAX];
+	size_t pages, i;
+	uint8_t order = 0;
+	paddr_t paddr;
+
+	if (shm_name(ctx, buf, name) != 0 || size == 0 || size > SHM_MAX_SIZE)
+		return -1;
+	if (find_shm(buf) != NULL || nr_shm_regions == SHM_MAX_REGIONS)
+		return -1;
+
+	pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	while ((1ul << order) < pages)
+		order++;
+
+	paddr = alloc_pages(order);
+	if (paddr == 0)
+		return -1;
+
+	/* Pages are referenced one by one, the unused tail goes back */
+	split_pages(paddr, order);
+	for (i = pages; i < (1ul << order); i++)
+		free_page(paddr + i * PAGE_SIZE);
+	for (i = 0; i < pages; i++)
+		clear_page(paddr + i * PAGE_SIZE);
+
+	region = shm_regions + nr_shm_regions++;
+	memcpy(region->name, buf, SHM_NAME_MAX);
+	region->paddr = paddr;
+	region->size = pages * PAGE_SIZE;
+
+	return region->size;
+}
+
+/* The pages are mapped on first access, like any other area */
+int64_t shm_attach(struct task *ctx, vaddr_t name, vaddr_t vaddr)
+{
+	struct shm_region *region;
+	char buf[SHM_NAME_MAX];
+
+	if (shm_name(ctx, buf, name) != 0)
+		return -1;
+
+	region = find_shm(buf);
+	if (region == NULL)
+		return -1;
+
+	if ((vaddr & (PAGE_SIZE - 1)) || !is_user_range(vaddr, region->size))
+		return -1;
+
+	if (add_vma(ctx, vaddr, vaddr + region->size, VMA_SHARED,
+		    VMA_READ | VMA_WRITE, region->paddr) != 0)
+		return -1;
+
+	return region->size;
+}
+
+/*
+ * Return the leaf entry (PML1, or PML2 for a 2 MiB page) mapping vaddr in
+ * the page table pgt, or NULL if one of the intermediate levels is not
+ * present.
+ */
+static paddr_t *lookup_pte(paddr_t pgt, vaddr_t vaddr)
+{
+	paddr_t *pml = (paddr_t *)pgt;
+	uint16_t index;
+
+	for (uint8_t level = 4; level > 1; level--) {
+		index = PTE_GET_INDEX_FOR_LVL(vaddr, level);
+		if (!PTE_IS_VALID(pml[index]))
+			return NULL;
+		if (PTE_IS_HUGE(pml[index]))
+			return &pml[index];
+		pml = (paddr_t *)PTE_NEXT_ADDR(pml[index]);
+	}
+
+	return &pml[PTE_GET_INDEX_PML1(vaddr)];
+}
+
+static uint64_t time_memcpy(void *dst, const void *src)
+{
+	uint64_t start, t, best = ~0ul;
+	size_t i;
+
+	for (i = 0; i <= PAGE_OPS_ROUNDS; i++) {
+		start = rdtsc();
+		memcpy(dst, src, PAGE_SIZE);
+		t = rdtsc() - start;
+		if (i > 0 && t < best)
+			best = t;
 	}
-	free_page(PTE_NEXT_ADDR(pgt[index]));
-	pgt[index] = 0;
+
+	return best;
+}
+
+/*
+ * Compare memcpy into a write-back page with the same copy into an
+ * uncached one. A frame must never be mapped with two memory types, so
+ * the uncached page is not an alias: a whole 2 MiB block of the pool is
+ * taken and its own identity mapping turns uncached for the test. The
+ * cache is written back around it, no line of the block survives under
+ * the other type. Only the boot processor runs at this point.
+ */
+static void check_cache_modes(void)
+{
+	paddr_t src = alloc_page(), dst = alloc_pages(HUGE_PAGE_ORDER);
+	paddr_t *pte = lookup_pte(kernel_pgt, dst);
+	paddr_t saved;
+	uint64_t wb, uc;
+
+	if (src == 0 || dst == 0 || pte == NULL || !PTE_IS_HUGE(*pte))
+		goto out;
+
+	wb = time_memcpy((void *)dst, (void *)src);
+
+	saved = *pte;
+	wbinvd();
+	*pte = (saved & ~PTE_CACHE_UC) | PTE_CACHE_UC;
+	invlpg(dst);
+	uc = time_memcpy((void *)dst, (void *)src);
+	*pte = saved;
+	invlpg(dst);
+	wbinvd();
+
+	printk("[memory] memcpy 4 KiB: %lu cycles write-back, %lu uncached\n",
+	       wb, uc);
+ out:
+	free_pages(dst, HUGE_PAGE_ORDER);
+	free_page(src);
+}
+
+/*
+ * Resolve a write fault on a copy-on-write page: the last owner of a frame
+ * gets it back writable, any other owner gets a private copy.
+ */
+static int break_cow(paddr_t *pte, vaddr_t vaddr)
+{
+	uint8_t order = PTE_IS_HUGE(*pte) ? HUGE_PAGE_ORDER : 0;
+	paddr_t old = PTE_NEXT_ADDR(*pte);
+	paddr_t new;
+
+	if (page_refs(old) == 1) {
+		*pte = (*pte & ~PTE_FLAG_COW) | PTE_FLAG_RW;
+		invlpg(vaddr);
+		return 0;
+	}
+
+	new = alloc_pages(order);
+	if (new == 0)
+		return -1;
+
+	copy_pages(new, old, order);
+	*pte = new | (PTE_FLAGS(*pte) & ~PTE_FLAG_COW) | PTE_FLAG_RW;
+	free_pages(old, order);
 	invlpg(vaddr);
+
+	return 0;
+}
+
+/*
+ * Map the page containing vaddr, which belongs to the area vma of ctx,
+ * and return the amount of pages mapped or -1.
+ * Image pages are mapped read-only and copied on the first write, so the
+ * image itself is never modified. Anonymous and shared pages are zero
+ * filled, shared ones are kept shared by fork instead of being COW.
+ * Anonymous faults also map the unmapped pages of the area around vaddr.
+ */
+static int fault_in(struct task *ctx, const struct vma *vma, vaddr_t vaddr)
+{
+	vaddr_t page = vaddr & ~(PAGE_SIZE - 1);
+	vaddr_t huge = vaddr & ~(HUGE_PAGE_SIZE - 1);
+	paddr_t paddr, flags = PTE_FLAG_VALID | PTE_FLAG_USER;
+	vaddr_t start, end;
+	paddr_t *pte;
+	int done = 1;
+
+	if (vma->type == VMA_IMAGE) {
+		if (vma->prot & VMA_WRITE)
+			flags |= PTE_FLAG_COW;
+		paddr = vma->paddr + (huge - vma->start);
+
+		/* Image alignee sur 2 MiB en virtuel et en physique */
+		if (huge >= vma->start && huge + HUGE_PAGE_SIZE <= vma->end
+		    && is_huge_aligned(paddr)
+		    && install_pte(ctx, huge, paddr, 2,
+				   flags | PTE_FLAG_HUGE) == 0)
+			return HUGE_PAGE_SIZE / PAGE_SIZE;
+
+		paddr = vma->paddr + (page - vma->start);
+		if (install_pte(ctx, page, paddr, 1, flags) != 0)
+			return -1;
+		return 1;
+	}
+
+	if (vma->prot & VMA_WRITE)
+		flags |= PTE_FLAG_RW;
+	if (vma->type == VMA_SHARED)
+		flags |= PTE_FLAG_SHARED;
+
+	/* Region nommee : la frame existe deja, une reference de plus */
+	if (vma->paddr != 0) {
+		paddr = vma->paddr + (page - vma->start);
+		if (install_pte(ctx, page, paddr, 1, flags) != 0)
+			return -1;
+		ref_page(paddr);
+		return 1;
+	}
+
+	pte = walk_pgt(ctx, page, 1);
+	if (pte == NULL || PTE_IS_VALID(*pte))
+		return -1;
+
+	paddr = alloc_zeroed_page();
+	if (paddr == 0)
+		return -1;
+	*pte = paddr | flags;
+
+	if (vma->type != VMA_ANONYMOUS)
+		return 1;
+
+	/* Fault-around : les voisines libres de la meme PML1 sont mappees */
+	start = vaddr & ~(FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+	end = start + FAULT_AROUND_PAGES * PAGE_SIZE;
+	if (start < vma->start)
+		start = vma->start;
+	if (end > vma->end)
+		end = vma->end;
+
+	pte -= (page - start) / PAGE_SIZE;
+	for (; start < end; start += PAGE_SIZE, pte++) {
+		if (PTE_IS_VALID(*pte))
+			continue;
+
+		paddr = alloc_zeroed_page();
+		if (paddr == 0)
+			break;
+		*pte = paddr | flags;
+		done++;
+	}
+
+	return done;
 }
 
+/*
+ * Every valid fault falls in an area of the task, found in O(log n) in
+ * its tree of areas. A fault on a present page is a write on a COW page,
+ * a fault on a missing page is resolved according to the area backing.
+ */
 void pgfault(struct interrupt_context *ctx)
 {
 	paddr_t faulty_addr = store_cr2();
-	
-	/* Seules les fautes de page dans la pile sont valides.*/
-	if (faulty_addr > USER_STACK_START || faulty_addr < USER_STACK_END) {
-		exit_task(ctx);
+	struct task *task = current();
+	const struct vma *vma;
+	paddr_t *pte;
+	int done;
+
+	task->faults++;
+
+	vma = find_vma(task, faulty_addr);
+	if (vma == NULL || ((ctx->errcode & PGFAULT_WRITE)
+			    && !(vma->prot & VMA_WRITE))) {
+		exit_task();
 		return;
 	}
-	mmap(current(), faulty_addr);
+
+	if (ctx->errcode & PGFAULT_PRESENT) {
+		pte = lookup_pte(task->pgt, faulty_addr);
+		if (!(ctx->errcode & PGFAULT_WRITE)
+		    || pte == NULL || !PTE_IS_COW(*pte)
+		    || break_cow(pte, faulty_addr & ~(PAGE_SIZE - 1)) != 0)
+			exit_task();
+		return;
+	}
+
+	done = fault_in(task, vma, faulty_addr);
+	if (done < 0)
+		exit_task();
+	else
+		task->fault_pages += done;
+}
+
+/*
+ * Return the leaf entry mapping the user address vaddr of ctx, after
+ * faulting it in like pgfault would, or NULL if a read at vaddr would kill
+ * the task.
+ */
+static paddr_t *user_pte(struct task *ctx, vaddr_t vaddr)
+{
+	const struct vma *vma = find_vma(ctx, vaddr);
+	paddr_t *pte;
+	int done;
+
+	if (vma == NULL || !(vma->prot & VMA_READ))
+		return NULL;
+
+	pte = lookup_pte(ctx->pgt, vaddr);
+	if (pte != NULL && PTE_IS_VALID(*pte))
+		return pte;
+
+	done = fault_in(ctx, vma, vaddr);
+	if (done < 0)
+		return NULL;
+	ctx->fault_pages += done;
+
+	pte = lookup_pte(ctx->pgt, vaddr);
+	if (pte == NULL || !PTE_IS_VALID(*pte) || !PTE_IS_USER(*pte))
+		return NULL;
+	return pte;
+}
+
+/* Bytes from vaddr to the end of the page (4 KiB or 2 MiB) mapped by pte */
+static size_t user_page_left(paddr_t pte, vaddr_t vaddr)
+{
+	size_t size = PTE_IS_HUGE(pte) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+
+	return size - (vaddr & (size - 1));
 }
 
-void duplicate_task(struct task *ctx)
+/*
+ * The page table of ctx must be the one in CR3, which is the case for the
+ * task doing a system call: once a page is checked it is read through its
+ * user address.
+ */
+int copy_from_user(struct task *ctx, void *dst, vaddr_t src, size_t len)
 {
+	paddr_t *pte;
+	size_t n;
+
+	if (src + len < src)
+		return -1;
+
+	while (len > 0) {
+		pte = user_pte(ctx, src);
+		if (pte == NULL)
+			return -1;
+
+		n = user_page_left(*pte, src);
+		if (n > len)
+			n = len;
+
+		memcpy(dst, (const void *)src, n);
+		dst = (char *)dst + n;
+		src += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Physical address of the user byte at vaddr. A COW page would move to
+ * another frame on the next write, it is copied first: the address stays
+ * valid until the page is unmapped.
+ */
+paddr_t user_paddr(struct task *ctx, vaddr_t vaddr)
+{
+	const struct vma *vma = find_vma(ctx, vaddr);
+	paddr_t *pte;
+	size_t size;
+
+	if (vma == NULL || !(vma->prot & VMA_WRITE))
+		return 0;
+
+	pte = user_pte(ctx, vaddr);
+	if (pte == NULL)
+		return 0;
+
+	if (PTE_IS_COW(*pte) && break_cow(pte, vaddr & ~(PAGE_SIZE - 1)) != 0)
+		return 0;
+
+	size = PTE_IS_HUGE(*pte) ? HUGE_PAGE_SIZE : PAGE_SIZE;
+	return (PTE_NEXT_ADDR(*pte) & ~(size - 1)) | (vaddr & (size - 1));
+}
+
+int64_t strncpy_from_user(struct task *ctx, char *dst, vaddr_t src,
+			  size_t len)
+{
+	const char *str;
+	paddr_t *pte;
+	size_t n, i, done = 0;
+
+	while (done < len) {
+		pte = user_pte(ctx, src);
+		if (pte == NULL)
+			return -1;
+
+		n = user_page_left(*pte, src);
+		if (n > len - done)
+			n = len - done;
+
+		str = (const char *)src;
+		for (i = 0; i < n; i++) {
+			dst[done + i] = str[i];
+			if (str[i] == '\0')
+				return done + i;
+		}
+
+		done += n;
+		src += n;
+	}
+
+	return done;
+}
+
+/*
+ * Copy the page table pml of the given level for a forked task.
+ * Kernel entries are shared as is, intermediate tables are duplicated and
+ * user frames are shared read-only in both address spaces with the COW bit,
+ * except frames of shared areas which stay writable in both.
+ */
+static paddr_t duplicate_pgt(paddr_t pml, uint8_t level, vaddr_t base)
+{
+	paddr_t *src = (paddr_t *)pml;
+	paddr_t *dst;
+	paddr_t new, entry;
+	vaddr_t vaddr, size = 1ul << (12 + 9 * (level - 1));
+
+	new = alloc_zeroed_page();
+	if (new == 0)
+		return 0;
+	dst = (paddr_t *)new;
+
+	for (uint16_t i = 0; i < PGT_NR_ENTRIES; i++) {
+		entry = src[i];
+		vaddr = base + i * size;
+
+		if (!PTE_IS_VALID(entry))
+			continue;
+
+		if (vaddr + size <= USER_STACK_END) {
+			dst[i] = entry;
+			continue;
+		}
+
+		if (level > 1 && !PTE_IS_HUGE(entry)) {
+			new = duplicate_pgt(PTE_NEXT_ADDR(entry), level - 1,
+					    vaddr);
+			if (new == 0) {
+				/* Drop the references taken so far */
+				free_pgt((paddr_t)dst, level, base);
+				return 0;
+			}
+			dst[i] = new | PTE_FLAGS(entry);
+			continue;
+		}
+
+		if (PTE_IS_RW(entry) && !PTE_IS_SHARED(entry)) {
+			entry = (entry & ~PTE_FLAG_RW) | PTE_FLAG_COW;
+			src[i] = entry;
+		}
+
+		ref_page(PTE_NEXT_ADDR(entry));
+		dst[i] = entry;
+	}
+
+	return (paddr_t)dst;
+}
+
+/*
+ * On failure the child is left without address space (pgt and pcid are
+ * 0) and the parent keeps its own intact, some pages may just be COW.
+ */
+int duplicate_task(struct task *ctx)
+{
+	paddr_t ring = alloc_page();
+	paddr_t *pte;
+
+	/* Sharing the parent ring would mix their requests: no fork then */
+	if (ring == 0) {
+		ctx->pgt = 0;
+		ctx->pcid = 0;
+		return -1;
+	}
+
+	ctx->pgt = duplicate_pgt(ctx->pgt, 4, 0);
+	ctx->pcid = 0;
+
+	/* The parent lost write access to its pages, flush its TLB */
+	load_cr3(store_cr3());
+
+	pte = (ctx->pgt != 0) ? lookup_pte(ctx->pgt, SYSCALL_RING_VADDR) : NULL;
+	if (pte == NULL) {
+		if (ctx->pgt != 0)
+			free_pgt(ctx->pgt, 4, 0);
+		ctx->pgt = 0;
+		free_page(ring);
+		return -1;
+	}
+	alloc_pcid(ctx);
+
+	/* The ring page is shared by fork, the child gets its own copy */
+	copy_page(ring, ctx->ring);
+	free_page(ctx->ring);
+	*pte = ring | PTE_FLAGS(*pte);
+	ctx->ring = ring;
+
+	ctx->tlb_misses = 0;
+	ctx->switches = 0;
+	ctx->runtime = 0;
+	ctx->faults = 0;
+	ctx->fault_pages = 0;
+
+	return 0;
+}
+
+/*
+ * Release the user part of the page table pml of the given level: leaf
+ * frames first, then the tables themselves, bottom-up. Kernel entries are
+ * shared by every task and are left untouched.
+ */
+static void free_pgt(paddr_t pml, uint8_t level, vaddr_t base)
+{
+	paddr_t *tbl = (paddr_t *)pml;
+	paddr_t entry;
+	vaddr_t vaddr, size = 1ul << (12 + 9 * (level - 1));
+
+	for (uint16_t i = 0; i < PGT_NR_ENTRIES; i++) {
+		entry = tbl[i];
+		vaddr = base + i * size;
+
+		if (!PTE_IS_VALID(entry) || vaddr + size <= USER_STACK_END)
+			continue;
+
+		if (PTE_IS_HUGE(entry))
+			free_pages(PTE_NEXT_ADDR(entry), HUGE_PAGE_ORDER);
+		else if (level > 1)
+			free_pgt(PTE_NEXT_ADDR(entry), level - 1, vaddr);
+		else
+			free_page(PTE_NEXT_ADDR(entry));
+	}
+
+	free_page(pml);
+}
+
+void free_task(struct task *ctx)
+{
+	/* Never release the page table the MMU is walking */
+	if (active_pgt() == ctx->pgt)
+		unset_task();
+
+	free_pgt(ctx->pgt, 4, 0);
+	free_pcid(ctx);
+	ctx->pgt = 0;
 }
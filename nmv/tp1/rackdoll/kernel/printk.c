@@ -1,9 +1,21 @@
+#include <idt.h>
 #include <printk.h>
+#include <serial.h>
 #include <stdarg.h>
 #include <string.h>
 #include <vga.h>
 
 
+struct log_ring log_ring = {
+	.magic = LOG_RING_MAGIC,
+	.size  = LOG_RING_SIZE
+};
+
+static volatile int log_flushing;            /* one flusher at a time */
+static bool_t log_deferred;
+static uint8_t log_consoles = LOG_CONSOLE_VGA;
+
+
 struct vsnprintk_state
 {
 	char    *buffer;
@@ -24,12 +36,6 @@ static bool_t vsnprintk_handler(void *user, char c)
 	return 1;
 }
 
-static bool_t vprintk_handler(void *user __attribute__((unused)), char c)
-{
-	putc(c);
-	return 1;
-}
-
 
 struct vhprintk_format
 {
@@ -380,9 +386,136 @@ size_t printk(const char *format, ...)
 	return ret;
 }
 
+/*
+ * Writers reserve their bytes with a single atomic add, copy them and then
+ * publish them in reservation order. Interrupts are disabled between the
+ * reservation and the commit so a writer is never stuck behind itself.
+ */
+static void log_write(const char *str, size_t len)
+{
+	uint64_t rflags, start;
+	size_t i;
+
+	rflags = irq_save();
+	start = __atomic_fetch_add(&log_ring.reserved, len, __ATOMIC_RELAXED);
+
+	for (i = 0; i < len; i++)
+		log_ring.data[(start + i) & (LOG_RING_SIZE - 1)] = str[i];
+
+	while (__atomic_load_n(&log_ring.committed, __ATOMIC_ACQUIRE) != start)
+		asm volatile ("pause");
+	__atomic_store_n(&log_ring.committed, start + len, __ATOMIC_RELEASE);
+	irq_restore(rflags);
+}
+
+static bool_t starts_with(const char *str, const char *prefix)
+{
+	while (*prefix != '\0')
+		if (*str++ != *prefix++)
+			return 0;
+
+	return 1;
+}
+
+/* Is str the word name, followed by a separator? */
+static bool_t word_is(const char *str, const char *name)
+{
+	size_t len = strlen(name);
+
+	return starts_with(str, name)
+		&& (str[len] == ',' || str[len] == ' ' || str[len] == '\0');
+}
+
+void setup_console(const char *cmdline)
+{
+	const char *opt = "console=";
+	const char *ptr = cmdline;
+	uint8_t consoles = 0;
+
+	while (ptr != NULL && *ptr != '\0') {
+		if ((ptr == cmdline || ptr[-1] == ' ') && starts_with(ptr, opt))
+			break;
+		ptr++;
+	}
+
+	if (ptr != NULL && *ptr != '\0') {
+		ptr += strlen(opt);
+		while (*ptr != '\0' && *ptr != ' ') {
+			if (word_is(ptr, "vga"))
+				consoles |= LOG_CONSOLE_VGA;
+			else if (word_is(ptr, "serial") && setup_serial() == 0)
+				consoles |= LOG_CONSOLE_SERIAL;
+
+			while (*ptr != '\0' && *ptr != ' ' && *ptr != ',')
+				ptr++;
+			if (*ptr == ',')
+				ptr++;
+		}
+	}
+
+	log_consoles = consoles ? consoles : LOG_CONSOLE_VGA;
+}
+
+/*
+ * Text overwritten before being flushed is lost, the screen resumes with
+ * the oldest text still in the ring.
+ */
+size_t log_flush(void)
+{
+	uint64_t start, end, off;
+	size_t len, done = 0;
+
+	do {
+		if (__atomic_exchange_n(&log_flushing, 1, __ATOMIC_ACQUIRE))
+			return done;
+
+		start = log_ring.flushed;
+		end = __atomic_load_n(&log_ring.committed, __ATOMIC_ACQUIRE);
+		if (end - start > LOG_RING_SIZE)
+			start = end - LOG_RING_SIZE;
+
+		while (start != end) {
+			off = start & (LOG_RING_SIZE - 1);
+			len = LOG_RING_SIZE - off;
+			if (len > end - start)
+				len = end - start;
+
+			if (log_consoles & LOG_CONSOLE_VGA)
+				puts(log_ring.data + off, len);
+			if (log_consoles & LOG_CONSOLE_SERIAL)
+				serial_write(log_ring.data + off, len);
+			start += len;
+			done += len;
+		}
+
+		log_ring.flushed = end;
+		__atomic_store_n(&log_flushing, 0, __ATOMIC_RELEASE);
+
+		/* Un autre ecrivain a pu publier pendant la copie */
+	} while (__atomic_load_n(&log_ring.committed, __ATOMIC_ACQUIRE) != end);
+
+	return done;
+}
+
+void log_defer(bool_t defer)
+{
+	log_deferred = defer;
+	if (!defer)
+		log_flush();
+}
+
 size_t vprintk(const char *format, va_list ap)
 {
-	return vhprintk(vprintk_handler, NULL, format, ap);
+	char line[LOG_LINE_MAX];
+	size_t len;
+
+	len = vsnprintk(line, sizeof (line), format, ap);
+	log_write(line, len);
+
+	if (!log_deferred)
+		log_flush();
+
+	return len;
 }
 
 size_t snprintk(char *buffer, size_t size, const char *format, ...)
@@ -0,0 +1,93 @@
+#include <serial.h>
+#include <x86.h>
+
+
+#define COM1_PORT             0x3f8
+#define UART_DATA             0             /* DLAB=0: transmit/receive */
+#define UART_IER              1             /* DLAB=0: interrupt enable */
+#define UART_DLL              0             /* DLAB=1: divisor low byte */
+#define UART_DLH              1            /* DLAB=1: divisor high byte */
+#define UART_FCR              2                         /* FIFO control */
+#define UART_LCR              3                         /* line control */
+#define UART_MCR              4                        /* modem control */
+#define UART_LSR              5                          /* line status */
+
+#define UART_LCR_8N1          0x03
+#define UART_LCR_DLAB         0x80
+#define UART_FCR_ENABLE       0x07         /* enable and clear both FIFOs */
+#define UART_MCR_DTR_RTS      0x03
+#define UART_MCR_OUT2         0x08
+#define UART_MCR_LOOPBACK     0x10
+#define UART_LSR_THRE         0x20       /* transmit FIFO is empty */
+
+#define UART_BAUD_DIVISOR     1                        /* 115200 bauds */
+#define UART_FIFO_SIZE        16                        /* 16550A FIFO */
+
+
+static bool_t serial_ready;
+
+
+/*
+ * The transmit FIFO is only known to be empty, not how full it is: wait
+ * for it to drain, then push a whole FIFO worth of bytes without polling
+ * the line status in between.
+ */
+static void serial_send(const char *buf, size_t n)
+{
+	size_t i;
+
+	while (n > 0) {
+		while (!(in8(COM1_PORT + UART_LSR) & UART_LSR_THRE))
+			asm volatile ("pause");
+
+		for (i = 0; i < n && i < UART_FIFO_SIZE; i++)
+			out8(COM1_PORT + UART_DATA, buf[i]);
+
+		buf += i;
+		n -= i;
+	}
+}
+
+
+int setup_serial(void)
+{
+	out8(COM1_PORT + UART_IER, 0x00);             /* polled, no interrupts */
+	out8(COM1_PORT + UART_LCR, UART_LCR_DLAB);
+	out8(COM1_PORT + UART_DLL, UART_BAUD_DIVISOR & 0xff);
+	out8(COM1_PORT + UART_DLH, UART_BAUD_DIVISOR >> 8);
+	out8(COM1_PORT + UART_LCR, UART_LCR_8N1);
+	out8(COM1_PORT + UART_FCR, UART_FCR_ENABLE);
+
+	/* Sans UART, le port renvoie n'importe quoi : tester en loopback */
+	out8(COM1_PORT + UART_MCR, UART_MCR_LOOPBACK | UART_MCR_OUT2
+	     | UART_MCR_DTR_RTS);
+	out8(COM1_PORT + UART_DATA, 0xae);
+	if (in8(COM1_PORT + UART_DATA) != 0xae)
+		return -1;
+
+	out8(COM1_PORT + UART_MCR, UART_MCR_OUT2 | UART_MCR_DTR_RTS);
+	serial_ready = 1;
+	return 0;
+}
+
+/* Terminals expect "\r\n" at the end of lines */
+void serial_write(const char *str, size_t n)
+{
+	char buf[UART_FIFO_SIZE * 4];
+	size_t i, len = 0;
+
+	if (!serial_ready)
+		return;
+
+	for (i = 0; i < n; i++) {
+		if (len + 2 > sizeof (buf)) {
+			serial_send(buf, len);
+			len = 0;
+		}
+		if (str[i] == '\n')
+			buf[len++] = '\r';
+		buf[len++] = str[i];
+	}
+
+	serial_send(buf, len);
+}
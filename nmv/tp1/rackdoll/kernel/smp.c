@@ -0,0 +1,222 @@
+#include <fpu.h>
+#include <idt.h>
+#include <memory.h>
+#include <printk.h>
+#include <smp.h>
+#include <string.h>
+#include <syscall.h>
+#include <task.h>
+#include <types.h>
+#include <x86.h>
+
+
+#define TRAMPOLINE_PADDR       0x7000      /* below 1 MiB, page aligned */
+
+#define ICR_INIT               0x00000500
+#define ICR_STARTUP            0x00000600
+#define ICR_ASSERT             0x00004000
+#define ICR_ALL_BUT_SELF       0x000c0000
+
+#define AP_BOOT_TIMEOUT_US     100000
+#define SHOOTDOWN_THRESHOLD    32  /* pages flushed before a full flush */
+
+
+struct cpu cpus[SMP_MAX_CPUS];
+size_t     nr_cpus = 1;
+
+static uint8_t apic_cpu[256];              /* APIC id to index in cpus */
+
+static volatile int kernel_lock;
+static volatile int kernel_owner = -1;  /* index of the cpu owning the lock */
+static size_t kernel_depth;               /* nested lock_kernel() calls */
+
+
+/*
+ * Symbols used by the application processors startup code in entry.S
+ */
+extern char trampoline_start[];
+extern char trampoline_end[];
+
+uint32_t ap_next = 1;                 /* index of the next cpu to start */
+uint32_t ap_max = SMP_MAX_CPUS;     /* cpus beyond this one stop at once */
+uint64_t ap_stacks[SMP_MAX_CPUS];               /* initial stack pointers */
+
+
+struct cpu *this_cpu(void)
+{
+	return cpus + apic_cpu[lapic_id()];
+}
+
+void udelay(uint64_t us)
+{
+	uint64_t end = rdtsc() + us * tsc_khz / 1000;
+
+	while (rdtsc() < end)
+		asm volatile ("pause");
+}
+
+
+void lock_kernel(void)
+{
+	int me = this_cpu()->id;
+
+	if (kernel_owner == me) {
+		kernel_depth++;
+		return;
+	}
+
+	/*
+	 * Interrupts are disabled here: keep answering shootdowns or the
+	 * owner of the lock could wait for us forever.
+	 */
+	while (__atomic_exchange_n(&kernel_lock, 1, __ATOMIC_ACQUIRE)) {
+		tlb_flush_request();
+		asm volatile ("pause");
+	}
+
+	kernel_owner = me;
+	kernel_depth = 1;
+}
+
+void unlock_kernel(void)
+{
+	if (--kernel_depth > 0)
+		return;
+
+	kernel_owner = -1;
+	__atomic_store_n(&kernel_lock, 0, __ATOMIC_RELEASE);
+}
+
+
+void send_ipi(uint8_t apic_id, uint8_t vector)
+{
+	lapic_send(apic_id, ICR_ASSERT | vector);
+}
+
+void tlb_flush_request(void)
+{
+	struct cpu *cpu = this_cpu();
+	vaddr_t vaddr;
+
+	if (!cpu->flush_pending)
+		return;
+
+	if (cpu->pgt == cpu->flush_pgt) {
+		if (((cpu->flush_end - cpu->flush_start) >> 12)
+		    > SHOOTDOWN_THRESHOLD) {
+			load_cr3(store_cr3());
+		} else {
+			for (vaddr = cpu->flush_start; vaddr < cpu->flush_end;
+			     vaddr += 0x1000)
+				invlpg(vaddr);
+		}
+	}
+
+	__atomic_store_n(&cpu->flush_pending, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Only the processors walking pgt right now can hold its entries: the
+ * others flush them when they load it again (see set_task).
+ */
+void tlb_shootdown(paddr_t pgt, vaddr_t start, vaddr_t end)
+{
+	struct cpu *me = this_cpu();
+	size_t i;
+
+	for (i = 0; i < SMP_MAX_CPUS; i++) {
+		if (cpus + i == me || cpus[i].pgt != pgt)
+			continue;
+
+		cpus[i].flush_pgt = pgt;
+		cpus[i].flush_start = start;
+		cpus[i].flush_end = end;
+		__atomic_store_n(&cpus[i].flush_pending, 1, __ATOMIC_RELEASE);
+		send_ipi(cpus[i].apic_id, INT_USER_TLB);
+	}
+
+	for (i = 0; i < SMP_MAX_CPUS; i++)
+		while (cpus[i].flush_pending)
+			asm volatile ("pause");
+}
+
+
+/*
+ * Entry point of the application processors, called from entry.S on the
+ * idle stack of the cpu with the boot page table.
+ */
+__attribute__((noreturn))
+void main_ap(uint32_t index)
+{
+	struct cpu *cpu = cpus + index;
+
+	cpu->id = index;
+	cpu->apic_id = lapic_id();
+	cpu->pgt = store_cr3();
+	apic_cpu[cpu->apic_id] = index;
+
+	load_interrupts();
+	setup_tss();
+	setup_syscalls();
+	setup_fpu();
+	setup_tlb();
+	setup_apic();
+
+	lock_kernel();
+	printk("[smp] cpu %u online (apic %u)\n", index, cpu->apic_id);
+	__atomic_add_fetch(&nr_cpus, 1, __ATOMIC_RELEASE);
+	unlock_kernel();
+
+	cpu->idle = 1;
+	sti();
+	while (1)
+		asm volatile ("hlt");
+}
+
+/*
+ * Wake up every other processor with the INIT-SIPI-SIPI sequence. They
+ * start in real mode at TRAMPOLINE_PADDR, switch to long mode like the
+ * bootstrap processor did and pick a slot in cpus in arrival order.
+ */
+void setup_smp(void)
+{
+	size_t len = trampoline_end - trampoline_start;
+	uint32_t started;
+	uint64_t waited;
+	size_t i;
+
+	cpus[0].id = 0;
+	cpus[0].apic_id = lapic_id();
+	cpus[0].pgt = store_cr3();
+	apic_cpu[cpus[0].apic_id] = 0;
+
+	for (i = 1; i < SMP_MAX_CPUS; i++)
+		ap_stacks[i] = (uint64_t) (cpus[i].idle_stack + CPU_STACK_SIZE);
+
+	memcpy((void *) TRAMPOLINE_PADDR, trampoline_start, len);
+
+	lapic_send(0, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_INIT);
+	udelay(10000);
+	for (i = 0; i < 2; i++) {
+		lapic_send(0, ICR_ALL_BUT_SELF | ICR_ASSERT | ICR_STARTUP
+			   | (TRAMPOLINE_PADDR >> 12));
+		udelay(200);
+	}
+
+	/*
+	 * There is no way to know how many processors woke up: give them some
+	 * time to take a slot, then wait for the ones which did.
+	 */
+	udelay(10000);
+	started = __atomic_load_n(&ap_next, __ATOMIC_ACQUIRE);
+	if (started > ap_max)
+		started = ap_max;
+
+	for (waited = 0; waited < AP_BOOT_TIMEOUT_US; waited += 1000) {
+		if (__atomic_load_n(&nr_cpus, __ATOMIC_ACQUIRE) >= started)
+			break;
+		udelay(1000);
+	}
+
+	printk("[smp] %lu cpus online\n", nr_cpus);
+}
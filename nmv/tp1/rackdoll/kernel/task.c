@@ -1,5 +1,7 @@
+#include <fpu.h>
 #include <memory.h>
 #include <printk.h>
+#include <smp.h>
 #include <string.h>
 #include <syscall.h>
 #include <task.h>
@@ -19,13 +21,34 @@
 #define MB2_TAG_ELF       9
 #define MB2_TAG_APM       10
 
-#define TASK_FIFO_LEN     32
+/*
+ * Multi-level feedback queue: a task using its whole slice drops one level
+ * and gets a twice longer slice, a task giving the cpu back early climbs
+ * one level. Every SCHED_BOOST_MS all the tasks go back to the top level
+ * so that CPU-bound tasks never starve.
+ * Every processor has its own queues (see smp.h), an idle processor steals
+ * tasks from the busiest one.
+ */
+#define SCHED_SLICE_MS    10       /* time before a top level task is preempted */
+#define SCHED_SLICE_TICKS (SCHED_SLICE_MS * TIMER_HZ / 1000)
+#define SCHED_BOOST_MS    1000
+#define SCHED_BOOST_TICKS (SCHED_BOOST_MS * TIMER_HZ / 1000)
+
+
+/*
+ * Tasks blocked in SYSCALL_WAIT, chained through their next field in the
+ * bucket of the physical address they wait on.
+ */
+#define WAIT_HASH_BITS    6
+#define WAIT_HASH_SIZE    (1 << WAIT_HASH_BITS)
+
 
+extern __attribute__((noreturn)) void die(void);
 
-static struct interrupt_context save;         /* kernel before running tasks */
-static struct task fifo[TASK_FIFO_LEN];           /* fifo of available tasks */
-static size_t fifo_size = 0;                   /* amount of task in the fifo */
-static size_t fifo_run = 0;                      /* current task in the fifo */
+
+static size_t nr_tasks;                    /* amount of task not yet exited */
+static int sched_started;           /* idle processors may now run tasks */
+static struct run_queue wait_table[WAIT_HASH_SIZE];   /* see wait_word() */
 
 
 struct mb2_info
@@ -40,6 +63,13 @@ struct mb2_tag
 	uint32_t  size;
 } __attribute__((packed));
 
+struct mb2_tag_cmdline
+{
+	uint32_t  type;
+	uint32_t  size;
+	char      string[];
+} __attribute__((packed));
+
 struct mb2_tag_module
 {
 	uint32_t  type;
@@ -50,14 +80,11 @@ struct mb2_tag_module
 } __attribute__((packed));
 
 
-struct task_state_segment tss __attribute__((aligned(0x1000)));
-
-
 /*
  * Symbol defined in entry.S
- * Points to a slot of the current GDT.
+ * Points to the TSS slots of the current GDT, one per processor.
  */
-extern uint64_t tss64[2];
+extern uint64_t tss64[SMP_MAX_CPUS][2];
 
 /* Util functions to set up the TSS descriptor. */
 #define TSS_ADDR_LOW(addr)			\
@@ -81,32 +108,231 @@ extern uint64_t tss64[2];
 
 void setup_tss(void)
 {
-	paddr_t tss_addr = (paddr_t) &tss;
+	struct cpu *cpu = this_cpu();
+	struct task_state_segment *tss = &cpu->tss;
+	paddr_t tss_addr = (paddr_t) tss;
+
+	memset(tss, 0, sizeof (*tss));
+	tss->rsp0 = (uint64_t) (cpu->kernel_stack + CPU_STACK_SIZE);
+	tss->iopb_off = OFFSETOF(struct task_state_segment, iopb);
+	tss->iopb = 0xffffffffffffffff;
+
+	tss64[cpu->id][0] |= TSS_ADDR_LOW(tss_addr);
+	tss64[cpu->id][0] |= TSS_SIZE(sizeof (*tss));
+	tss64[cpu->id][1] |= TSS_ADDR_HIGH(tss_addr);
+
+	load_tr(TSS_SELECTOR + cpu->id * sizeof (tss64[0]));
+}
+
+
+/* Symbol defined in syscall.S */
+extern char syscall_entry[];
+
+/*
+ * SYSRET returns to USER_CODE_SELECTOR with USER_DATA_SELECTOR, which are
+ * found 16 and 8 bytes after the selector in STAR[63:48] (see x86.h).
+ * Must be called after setup_tss(): system calls use the same stack.
+ */
+void setup_syscalls(void)
+{
+	struct cpu *cpu = this_cpu();
+
+	cpu->syscall_rsp = cpu->tss.rsp0;
+	wrmsr(MSR_KERNEL_GS_BASE, (uint64_t) cpu);
+
+	wrmsr(MSR_STAR, (((uint64_t) (KERNEL_DATA_SELECTOR | 3)) << 48)
+	      | (((uint64_t) KERNEL_CODE_SELECTOR) << 32));
+	wrmsr(MSR_LSTAR, (uint64_t) syscall_entry);
+	wrmsr(MSR_SFMASK, RFLAGS_IF | RFLAGS_DF | RFLAGS_TF | RFLAGS_AC);
+	wrmsr(MSR_EFER, rdmsr(MSR_EFER) | MSR_EFER_SCE);
+}
+
+
+/*
+ * Tasks live in frames of the physical allocator, which is identity mapped
+ * in every address space, so that their amount is only limited by memory.
+ */
+static uint8_t task_order(void)
+{
+	uint8_t order = 0;
+
+	while ((0x1000ul << order) < sizeof (struct task))
+		order++;
+
+	return order;
+}
+
+/* Symbols defined in switch.S */
+extern void switch_to(uint64_t *prev_ksp, uint64_t next_ksp);
+extern char task_entry[];
+
+static struct task *alloc_task(void)
+{
+	struct task *task = (struct task *) alloc_pages(task_order());
+	paddr_t kstack;
+
+	if (task == NULL)
+		return NULL;
+
+	kstack = alloc_pages(TASK_KSTACK_ORDER);
+	if (kstack == 0) {
+		free_pages((paddr_t) task, task_order());
+		return NULL;
+	}
 
-	memset(&tss, 0, sizeof (tss));
-	tss.rsp0 = store_rsp();
-	tss.iopb_off = OFFSETOF(struct task_state_segment, iopb);
-	tss.iopb = 0xffffffffffffffff;
+	memset(task, 0, sizeof (*task));
+	task->kstack = kstack;
+	return task;
+}
 
-	tss64[0] |= TSS_ADDR_LOW(tss_addr);
-	tss64[0] |= TSS_SIZE(sizeof (tss));
-	tss64[1] |= TSS_ADDR_HIGH(tss_addr);
+static void release_task(struct task *task)
+{
+	fpu_release(task);
+	free_pages(task->kstack, TASK_KSTACK_ORDER);
+	free_pages((paddr_t) task, task_order());
+}
 
-	load_tr(TSS_SELECTOR);
+/* User registers of the task, saved on top of its kernel stack by traps */
+static struct interrupt_context *task_context(struct task *task)
+{
+	return (struct interrupt_context *) (task->kstack + TASK_KSTACK_SIZE) - 1;
 }
 
+/*
+ * Stack of a task which never ran: what switch_to() pops (callee-saved
+ * registers and return address) under the user registers.
+ */
+static void init_kstack(struct task *task)
+{
+	uint64_t *sp = (uint64_t *) (task->kstack + TASK_KSTACK_SIZE
+				     - sizeof (struct interrupt_context));
+	size_t i;
+
+	*--sp = (uint64_t) task_entry;
+	for (i = 0; i < 6; i++)
+		*--sp = 0;
+
+	task->ksp = (uint64_t) sp;
+}
+
+static void enqueue_task(struct cpu *cpu, struct task *task)
+{
+	struct run_queue *rq = cpu->run_queue + task->level;
+
+	task->state = TASK_READY;
+	task->next = NULL;
+
+	if (rq->tail == NULL)
+		rq->head = task;
+	else
+		rq->tail->next = task;
+	rq->tail = task;
+
+	cpu->run_levels |= (1u << task->level);
+	cpu->nr_ready++;
+}
+
+static struct task *dequeue_task(struct cpu *cpu, uint8_t level)
+{
+	struct run_queue *rq = cpu->run_queue + level;
+	struct task *task = rq->head;
+
+	rq->head = task->next;
+	if (rq->head == NULL) {
+		rq->tail = NULL;
+		cpu->run_levels &= ~(1u << level);
+	}
+	cpu->nr_ready--;
+
+	task->next = NULL;
+	return task;
+}
+
+/* Take the first task of the highest non empty level, NULL if none */
+static struct task *pick_task(struct cpu *cpu)
+{
+	if (cpu->run_levels == 0)
+		return NULL;
+
+	return dequeue_task(cpu, __builtin_ctz(cpu->run_levels));
+}
+
+/*
+ * Take a task of the lowest non empty level of the busiest processor: the
+ * victim keeps its most urgent tasks.
+ */
+static struct task *steal_task(struct cpu *thief)
+{
+	struct cpu *victim = NULL;
+	size_t i;
+
+	for (i = 0; i < SMP_MAX_CPUS; i++) {
+		if (cpus + i == thief || cpus[i].nr_ready == 0)
+			continue;
+		if (victim == NULL || cpus[i].nr_ready > victim->nr_ready)
+			victim = cpus + i;
+	}
+
+	if (victim == NULL)
+		return NULL;
+
+	return dequeue_task(victim, 31 - __builtin_clz(victim->run_levels));
+}
+
+static void boost_tasks(struct cpu *cpu)
+{
+	struct run_queue *top = cpu->run_queue;
+	struct run_queue *rq;
+	struct task *task;
+	uint8_t level;
+
+	for (level = 1; level < SCHED_NR_LEVELS; level++) {
+		rq = cpu->run_queue + level;
+		if (rq->head == NULL)
+			continue;
+
+		for (task = rq->head; task; task = task->next)
+			task->level = 0;
+
+		if (top->tail == NULL)
+			top->head = rq->head;
+		else
+			top->tail->next = rq->head;
+		top->tail = rq->tail;
+
+		rq->head = NULL;
+		rq->tail = NULL;
+	}
+
+	if (top->head != NULL)
+		cpu->run_levels = 1;
+	if (cpu->running != NULL)
+		cpu->running->level = 0;
+}
+
+/*
+ * The boost rewrites the run queues: it is only done from the idle loop or
+ * over user code, never over a kernel path which may be walking them. A
+ * boost due during a kernel path waits for the next such tick.
+ */
+static void boost_due(struct cpu *cpu)
+{
+	if (cpu->sched_ticks < SCHED_BOOST_TICKS)
+		return;
+
+	cpu->sched_ticks = 0;
+	boost_tasks(cpu);
+}
 
 static void parse_task(const struct mb2_tag_module *tag)
 {
 	const uint64_t *ptr = (const uint64_t *) ((uint64_t) tag->mod_start);
 	const uint64_t *end = (const uint64_t *) ((uint64_t) tag->mod_end);
 	const struct task_header *header;
+	struct interrupt_context *ctx;
 	struct task *task;
 	size_t pvdiff;
 
-	if (fifo_size == TASK_FIFO_LEN)
-		return;
-
 	while (ptr < end) {
 		if (*ptr == TASK_HEADER_MAGIC)
 			break;
@@ -116,9 +342,9 @@ static void parse_task(const struct mb2_tag_module *tag)
 	if (ptr == end)
 		return;
 
-	task = fifo + fifo_size;
-	memset(task, 0, sizeof (*task));
-	fifo_size++;
+	task = alloc_task();
+	if (task == NULL)
+		return;
 
 	header = (const struct task_header *) ptr;
 	pvdiff = header->header_addr - ((paddr_t) ptr);
@@ -127,60 +353,393 @@ static void parse_task(const struct mb2_tag_module *tag)
 	task->load_vaddr = header->load_addr;
 	task->bss_end_vaddr = header->bss_end_addr;
 
-	task->context.rip = header->entry_addr;
-	task->context.cs = USER_CODE_SELECTOR | 0x3;
-	task->context.ss = USER_DATA_SELECTOR | 0x3;
-	task->context.rsp = 0x2000000000;
-	task->context.rflags = RFLAGS_IF;
+	ctx = task_context(task);
+	memset(ctx, 0, sizeof (*ctx));
+	ctx->rip = header->entry_addr;
+	ctx->cs = USER_CODE_SELECTOR | 0x3;
+	ctx->ss = USER_DATA_SELECTOR | 0x3;
+	ctx->rsp = 0x2000000000;
+	ctx->rflags = RFLAGS_IF;
+	init_kstack(task);
+
+	if (load_task(task) != 0) {
+		release_task(task);
+		return;
+	}
+	nr_tasks++;
+	enqueue_task(this_cpu(), task);
+}
 
-	load_task(task);
+#define PRINT_CHUNK  128
+
+/* Print a user string piece by piece, return its length or -1 */
+static int64_t print_user(struct task *task, vaddr_t str)
+{
+	char buf[PRINT_CHUNK];
+	int64_t len, total = 0;
+
+	do {
+		len = strncpy_from_user(task, buf, str + total, sizeof(buf) - 1);
+		if (len < 0)
+			return -1;
+		buf[len] = '\0';
+		printk("%s", buf);
+		total += len;
+	} while (len == sizeof(buf) - 1);
+
+	return total;
 }
 
-static void syscall_handler(struct interrupt_context *ctx)
+static struct run_queue *wait_queue(paddr_t key)
 {
-	uint64_t arg0 = ctx->rsi;
+	return wait_table + (((key >> 2) * 0x9e3779b97f4a7c15ul)
+			     >> (64 - WAIT_HASH_BITS));
+}
 
-	switch (ctx->rdi) {
+/*
+ * The check of the word and the sleep are atomic since wake_word() needs
+ * the kernel lock too: a task which changes the word then wakes its
+ * waiters cannot miss one.
+ */
+static int64_t wait_word(struct task *task, vaddr_t addr, uint32_t expected)
+{
+	struct run_queue *queue;
+	paddr_t key;
+
+	if (addr & 3)
+		return -1;
+
+	key = user_paddr(task, addr);
+	if (key == 0)
+		return -1;
+
+	if (__atomic_load_n((uint32_t *) key, __ATOMIC_ACQUIRE) != expected)
+		return 1;
+
+	queue = wait_queue(key);
+	task->wait_key = key;
+	task->next = NULL;
+	if (queue->tail == NULL)
+		queue->head = task;
+	else
+		queue->tail->next = task;
+	queue->tail = task;
+
+	block_task();
+	return 0;
+}
+
+/* Wake the n first tasks waiting on addr, in arrival order */
+static int64_t wake_word(struct task *task, vaddr_t addr, size_t n)
+{
+	struct task *prev = NULL, *cur, *next;
+	struct run_queue *queue;
+	int64_t done = 0;
+	paddr_t key;
+
+	if (addr & 3)
+		return -1;
+
+	key = user_paddr(task, addr);
+	if (key == 0)
+		return -1;
+
+	queue = wait_queue(key);
+	for (cur = queue->head; cur != NULL && (size_t) done < n; cur = next) {
+		next = cur->next;
+		if (cur->wait_key != key) {
+			prev = cur;
+			continue;
+		}
+
+		if (prev == NULL)
+			queue->head = next;
+		else
+			prev->next = next;
+		if (queue->tail == cur)
+			queue->tail = prev;
+
+		wake_task(cur);
+		done++;
+	}
+
+	return done;
+}
+
+/* System calls which never switch task, either direct or from the ring */
+static int64_t do_syscall(struct task *task, uint64_t callnum,
+			  const uint64_t *args)
+{
+	switch (callnum) {
 	case SYSCALL_PRINT:
-		printk("%s", arg0);
-		break;
+		return print_user(task, args[0]);
 	case SYSCALL_PRINTNUM:
-		printk("%lu", arg0);
-		break;
+		printk("%lu", args[0]);
+		return 0;
 	case SYSCALL_MMAP:
-		mmap(fifo + fifo_run, arg0);
-		break;
+		return mmap(task, args[0]);
 	case SYSCALL_MUNMAP:
-		munmap(fifo + fifo_run, arg0);
-		break;
+		munmap(task, args[0]);
+		return 0;
+	case SYSCALL_MMAP_HUGE:
+		return mmap_huge(task, args[0], args[1]);
+	case SYSCALL_MMAP_RANGE:
+		return mmap_range(task, args[0], args[1]);
+	case SYSCALL_MUNMAP_RANGE:
+		return munmap_range(task, args[0], args[1]);
+	case SYSCALL_NOP:
+		return 0;
+	case SYSCALL_WAKE:
+		return wake_word(task, args[0], args[1]);
+	case SYSCALL_SHM_CREATE:
+		return shm_create(task, args[0], args[1]);
+	case SYSCALL_SHM_ATTACH:
+		return shm_attach(task, args[0], args[1]);
+	case SYSCALL_FPU_RESTORES:
+		return task->fpu_restores;
+	}
+
+	return -1;
+}
+
+/*
+ * Run the requests queued in the ring of task, as long as there is room
+ * for their completions. The ring is read through its identity mapping,
+ * and each request is copied first since the task can still write it.
+ * Return the number of requests run.
+ */
+static uint64_t ring_enter(struct task *task)
+{
+	struct syscall_ring *ring = (struct syscall_ring *) task->ring;
+	uint32_t head = ring->sq_head;
+	uint32_t tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+	uint32_t cq_tail = ring->cq_tail;
+	struct syscall_sqe sqe;
+	struct syscall_cqe *cqe;
+	uint64_t done = 0;
+
+	while (head != tail && cq_tail - __atomic_load_n(&ring->cq_head,
+			       __ATOMIC_ACQUIRE) < SYSCALL_RING_ENTRIES) {
+		sqe = ring->sq[head % SYSCALL_RING_ENTRIES];
+		cqe = ring->cq + (cq_tail % SYSCALL_RING_ENTRIES);
+
+		cqe->user_data = sqe.user_data;
+		cqe->result = do_syscall(task, sqe.callnum, sqe.args);
+
+		head++;
+		cq_tail++;
+		done++;
+	}
+
+	__atomic_store_n(&ring->cq_tail, cq_tail, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->sq_head, head, __ATOMIC_RELEASE);
+	return done;
+}
+
+static void syscall_handler(struct interrupt_context *ctx)
+{
+	uint64_t args[SYSCALL_MAX_ARGS] = {
+		ctx->rdi, ctx->rsi, ctx->rdx, ctx->r10, ctx->r8, ctx->r9
+	};
+
+	switch (ctx->rax) {
 	case SYSCALL_YIELD:
-		next_task(ctx);
+		next_task();
 		break;
 	case SYSCALL_EXIT:
-		exit_task(ctx);
+		exit_task();
 		break;
 	case SYSCALL_FORK:
 		fork_task(ctx);
 		break;
+	case SYSCALL_RING_ENTER:
+		ctx->rax = ring_enter(current());
+		break;
+	case SYSCALL_WAIT:
+		ctx->rax = wait_word(current(), args[0], args[1]);
+		break;
+	default:
+		ctx->rax = do_syscall(current(), ctx->rax, args);
+		break;
 	}
 }
 
-static void enter_handler(struct interrupt_context *ctx)
+/*
+ * Called by syscall.S with the context of the calling task, on top of its
+ * kernel stack. Return 1 if it can go back with SYSRET: other tasks which
+ * ran in between returned through their own stack.
+ */
+int syscall_fast(struct interrupt_context *ctx)
+{
+	lock_kernel();
+	syscall_handler(ctx);
+	unlock_kernel();
+
+	return (ctx->cs & 3) == 3;
+}
+
+/* Charge the time since the last switch to the task leaving the cpu */
+static void account_task(struct cpu *cpu, struct task *task)
 {
-	struct task *task = (struct task *) ctx->rdi;
+	uint64_t now = rdtsc();
+
+	task->runtime += now - cpu->run_start;
+	cpu->run_start = now;
+}
 
-	save = *ctx;
+static void start_task(struct cpu *cpu, struct task *task)
+{
+	uint64_t top = task->kstack + TASK_KSTACK_SIZE;
+
+	cpu->running = task;
+	cpu->idle = 0;
+	cpu->tss.rsp0 = top;
+	cpu->syscall_rsp = top;
+	task->cpu = cpu->id;
+	task->state = TASK_RUNNING;
+	task->slice = SCHED_SLICE_TICKS << task->level;
 	set_task(task);
+	cpu->run_start = rdtsc();
+}
+
+/* First thing done on the stack switch_task() switched to */
+static void finish_switch(void)
+{
+	struct cpu *cpu = this_cpu();
+	struct task *dead = cpu->dead;
+
+	if (dead != NULL) {
+		cpu->dead = NULL;
+		release_task(dead);
+	}
+}
+
+/*
+ * Leave the context running on cpu (a task or the idle loop) for next, or
+ * for the idle loop if next is NULL. The kernel lock stays held across the
+ * switch and is released by the context we switch to, on its way out of
+ * the kernel. When this returns, the caller may run on another processor.
+ * A tick in the middle would save the wrong context: interrupts are off.
+ */
+static void switch_task(struct cpu *cpu, struct task *next)
+{
+	struct task *prev = cpu->running;
+	uint64_t *prev_ksp = (prev != NULL) ? &prev->ksp : &cpu->idle_ksp;
+	uint64_t next_ksp;
+
+	if (store_rflags() & RFLAGS_IF) {
+		printk("[error] switch_task: interrupts enabled\n");
+		die();
+	}
+
+	if (next != NULL) {
+		start_task(cpu, next);
+		next_ksp = next->ksp;
+	} else {
+		cpu->running = NULL;
+		cpu->idle = 1;
+		unset_task();
+		next_ksp = cpu->idle_ksp;
+	}
+
+	if (next == prev)
+		return;
+
+	fpu_switch(cpu, prev, next);
+	switch_to(prev_ksp, next_ksp);
+	finish_switch();
+}
+
+/* Called by task_entry (switch.S) the first time a task runs */
+void task_first_run(void)
+{
+	finish_switch();
+	unlock_kernel();
+}
+
+/*
+ * Give the cpu to the next ready task, local or stolen, or back to the
+ * idle loop if none.
+ */
+static void schedule(struct cpu *cpu)
+{
+	struct task *task = pick_task(cpu);
+
+	if (task == NULL)
+		task = steal_task(cpu);
 
-	*ctx = task->context;
+	switch_task(cpu, task);
 }
 
-static void enter_task(struct task *task)
+static void timer_handler(struct interrupt_context *ctx)
 {
-	asm volatile ("int %0" : : "i" (INT_USER_ENTER_TASKS), "D" (task));
+	struct cpu *cpu = this_cpu();
+	struct task *task = cpu->running;
+
+	lapic_eoi();
+
+	/* Safe anywhere, log_flush() backs off if a flush is under way */
+	if (cpu->id == 0)
+		log_flush();
+
+	cpu->sched_ticks++;
+
+	/* Un processeur inactif prend une tache, la sienne ou une volee */
+	if (task == NULL) {
+		if (!cpu->idle || !sched_started)
+			return;
+		boost_due(cpu);
+		task = pick_task(cpu);
+		if (task == NULL)
+			task = steal_task(cpu);
+		if (task == NULL) {
+			refill_zeroed_pages();       /* nothing better to do */
+			return;
+		}
+		switch_task(cpu, task);
+		return;
+	}
+
+	/* Only user code is preempted, the kernel is not reentrant */
+	if ((ctx->cs & 3) != 3)
+		return;
+
+	boost_due(cpu);
+
+	if (task->slice > 1) {
+		task->slice--;
+		return;
+	}
+
+	/* Slice entierement consommee : la tache descend d'un niveau */
+	account_task(cpu, task);
+	if (task->level < SCHED_NR_LEVELS - 1)
+		task->level++;
+	enqueue_task(cpu, task);
+	schedule(cpu);
 }
 
 
+const char *mb2_cmdline(const void *mb2)
+{
+	const struct mb2_info *info = (const struct mb2_info *) mb2;
+	const struct mb2_tag *tag;
+	vaddr_t ptr = (vaddr_t) mb2;
+	vaddr_t end = ptr + info->total_size;
+
+	ptr += (sizeof (*info) + 7) & ~0x7;
+	while (ptr < end) {
+		tag = (const struct mb2_tag *) ptr;
+		if (tag->type == MB2_TAG_CMDLINE)
+			return ((const struct mb2_tag_cmdline *) tag)->string;
+		if (tag->type == MB2_TAG_END)
+			break;
+		ptr = (ptr + tag->size + 7) & ~0x7;
+	}
+
+	return NULL;
+}
+
 void load_tasks(const void *mb2)
 {
 	const struct mb2_info *info = (const struct mb2_info *) mb2;
@@ -200,76 +759,116 @@ void load_tasks(const void *mb2)
 
 
 	interrupt_vector[INT_USER_SYSCALL] = syscall_handler;
-	interrupt_vector[INT_USER_ENTER_TASKS] = enter_handler;
+	interrupt_vector[INT_USER_TIMER] = timer_handler;
 }
 
 
 struct task *current(void)
 {
-	if (fifo_run >= fifo_size)
-		return NULL;
-	return fifo + fifo_run;
+	return this_cpu()->running;
 }
 
-void next_task(struct interrupt_context *ctx)
+void next_task(void)
 {
-	fifo[fifo_run].context = *ctx;
+	struct cpu *cpu = this_cpu();
+	struct task *task = cpu->running;
+
+	/* Rendre la main avant la fin de sa tranche fait monter la tache */
+	account_task(cpu, task);
+	if (task->level > 0 && task->slice > 1)
+		task->level--;
+	enqueue_task(cpu, task);
+	schedule(cpu);
+}
 
-	fifo_run++;
-	if (fifo_run >= fifo_size)
-		fifo_run = 0;
+/* Returns once another processor or handler called wake_task(current()) */
+void block_task(void)
+{
+	struct cpu *cpu = this_cpu();
+	struct task *task = cpu->running;
+
+	account_task(cpu, task);
+	if (task->level > 0)
+		task->level--;
+	task->state = TASK_BLOCKED;
+	schedule(cpu);
+}
 
-	set_task(fifo + fifo_run);
-	*ctx = fifo[fifo_run].context;
+void wake_task(struct task *task)
+{
+	if (task->state == TASK_BLOCKED)
+		enqueue_task(cpus + task->cpu, task);
 }
 
-void exit_task(struct interrupt_context *ctx)
+void exit_task(void)
 {
-	if (fifo_run == (fifo_size - 1)) {
-		fifo_size--;
-		fifo_run = 0;
-	} else {
-		fifo_size--;
-		fifo[fifo_run] = fifo[fifo_size];
-	}
+	struct cpu *cpu = this_cpu();
+	struct task *task = cpu->running;
 
-	if (fifo_size == 0) {
-		*ctx = save;
-	} else {
-		set_task(fifo + fifo_run);
-		*ctx = fifo[fifo_run].context;
-	}
+	account_task(cpu, task);
+	free_task(task);
+	printk("[task] exit: %lu ms, %lu switches, %lu TLB misses, %lu faults for %lu pages, %lu FPU loads\n",
+	       task->runtime / tsc_khz, task->switches, task->tlb_misses,
+	       task->faults, task->fault_pages, task->fpu_restores);
+
+	__atomic_sub_fetch(&nr_tasks, 1, __ATOMIC_RELEASE);
+
+	/* Its stack is in use until the switch, the next context frees it */
+	cpu->dead = task;
+	schedule(cpu);
 }
 
 void fork_task(struct interrupt_context *ctx)
 {
+	struct cpu *cpu = this_cpu();
 	struct task *task;
 	uint64_t ret = -1;
+	vaddr_t kstack;
 
-	if (fifo_size == TASK_FIFO_LEN)
+	task = alloc_task();
+	if (task == NULL)
 		goto out;
 
-	task = fifo + fifo_size;
-	fifo_size++;
+	kstack = task->kstack;
+	*task = *cpu->running;
+	task->kstack = kstack;
+	if (fpu_fork(task, cpu->running) != 0) {
+		release_task(task);
+		goto out;
+	}
 
-	*task = *current();
-	task->context = *ctx;
-	task->context.rax = 1;
-	duplicate_task(task);
+	*task_context(task) = *ctx;
+	task_context(task)->rax = 1;
+	init_kstack(task);
+	if (duplicate_task(task) != 0) {
+		release_task(task);
+		goto out;
+	}
+
+	nr_tasks++;
+	enqueue_task(cpu, task);
 
 	ret = 0;
  out:
 	ctx->rax = ret;
 }
 
+/*
+ * Let the processors run the loaded tasks, this one included: it idles
+ * like the others until every task exited.
+ */
 void run_tasks(void)
 {
-	if (fifo_size == 0)
+	struct cpu *cpu = this_cpu();
+
+	if (nr_tasks == 0)
 		return;
 
-	fifo_run++;
-	if (fifo_run >= fifo_size)
-		fifo_run = 0;
+	cpu->idle = 1;
+	__atomic_store_n(&sched_started, 1, __ATOMIC_RELEASE);
+
+	while (__atomic_load_n(&nr_tasks, __ATOMIC_ACQUIRE) > 0)
+		asm volatile ("hlt");
 
-	enter_task(fifo + fifo_run);
+	cpu->idle = 0;
 }
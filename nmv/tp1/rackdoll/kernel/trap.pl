@@ -41,9 +41,12 @@ _trap:
 	pushq   %rbx
 	pushq   %rbp
 
+	cld                             # iretq restores the interrupted DF
 	movq    %rsp, %rdi
 	call    trap
 
+	.globl  trap_return
+trap_return:                            # see task_entry in switch.S
 	popq    %rbp
 	popq    %rbx
 	popq    %r15
@@ -1,3 +1,4 @@
+#include <string.h>
 #include <vga.h>
 #include <x86.h>
 
@@ -12,12 +13,23 @@
 #define VGA_COLOR_DEFAULT         0x700
 
 
-static uint16_t cursor = 0;
+/*
+ * Text is first written in a copy of the screen kept in memory, where
+ * scrolling only moves the index of the top line. The lines which changed
+ * are then copied to the VGA memory and the cursor moved once per call.
+ */
+static uint16_t shadow[VGA_SCREEN_LINES][VGA_SCREEN_COLUMNS];
+static size_t top;                      /* shadow line on top of the screen */
+static size_t row, col;                              /* cursor position */
+static uint32_t dirty;                    /* bit n: screen line n changed */
 
-static void update_cursor(uint16_t pos)
+static uint16_t *shadow_line(size_t line)
 {
-	cursor = pos;
+	return shadow[(top + line) % VGA_SCREEN_LINES];
+}
 
+static void update_cursor(uint16_t pos)
+{
 	out8(VGA_CURSOR_ADDRESS_PORT, VGA_CURSOR_ADDRESS_LOW);
 	out8(VGA_CURSOR_DATA_PORT, pos & 0xff);
 
@@ -25,65 +37,88 @@ static void update_cursor(uint16_t pos)
 	out8(VGA_CURSOR_DATA_PORT, (pos >> 8) & 0xff);
 }
 
-static void scroll(void)
+static void clear_line(uint16_t *line)
 {
-	uint16_t *screen = VGA_SCREEN_ADDRESS;
-	size_t line, cursor, end;
-
-	for (line = 0; line < (VGA_SCREEN_LINES - 1); line++) {
-		cursor = line * VGA_SCREEN_COLUMNS;
-		end = cursor + VGA_SCREEN_COLUMNS;
-		while (cursor < end) {
-			screen[cursor] = screen[cursor + VGA_SCREEN_COLUMNS];
-			cursor++;
-		}
-	}
+	size_t i;
 
-	cursor = line * VGA_SCREEN_COLUMNS;
-	end = cursor + VGA_SCREEN_COLUMNS;
-	while (cursor < end) {
-		screen[cursor] = VGA_COLOR_DEFAULT;
-		cursor++;
-	}
+	for (i = 0; i < VGA_SCREEN_COLUMNS; i++)
+		line[i] = VGA_COLOR_DEFAULT;
 }
 
-
-void clear(void)
+static void scroll(void)
 {
-	size_t i, total = VGA_SCREEN_LINES * VGA_SCREEN_COLUMNS;
-	uint16_t *screen = VGA_SCREEN_ADDRESS;
+	top = (top + 1) % VGA_SCREEN_LINES;
+	clear_line(shadow_line(VGA_SCREEN_LINES - 1));
+	dirty = (1u << VGA_SCREEN_LINES) - 1;
+}
 
-	for (i = 0; i < total; i++)
-		screen[i] = VGA_COLOR_DEFAULT;
+static void newline(void)
+{
+	col = 0;
+	if (++row < VGA_SCREEN_LINES)
+		return;
 
-	update_cursor(0);
+	scroll();
+	row = VGA_SCREEN_LINES - 1;
 }
 
-void putc(char c)
+static void write_char(char c)
 {
-	uint16_t n = cursor;
-	uint16_t *screen = VGA_SCREEN_ADDRESS;
-
 	switch (c) {
 	case '\n':
-		n += VGA_SCREEN_COLUMNS;
+		newline();
+		break;
 	case '\r':
-		n = (n / VGA_SCREEN_COLUMNS) * VGA_SCREEN_COLUMNS;
+		col = 0;
 		break;
 	case '\t':
-		n = ((n + 1) & (~0x7)) + 8;
+		col = ((col + 1) & (~0x7)) + 8;
+		if (col >= VGA_SCREEN_COLUMNS)
+			newline();
 		break;
 	default:
-		screen[n++] = VGA_COLOR_DEFAULT | c;
+		shadow_line(row)[col] = VGA_COLOR_DEFAULT | (uint8_t) c;
+		dirty |= 1u << row;
+		if (++col == VGA_SCREEN_COLUMNS)
+			newline();
 		break;
 	}
+}
+
+static void flush_screen(void)
+{
+	uint16_t *screen = VGA_SCREEN_ADDRESS;
+	size_t line;
+
+	for (line = 0; line < VGA_SCREEN_LINES; line++)
+		if (dirty & (1u << line))
+			memcpy(screen + line * VGA_SCREEN_COLUMNS,
+			       shadow_line(line),
+			       VGA_SCREEN_COLUMNS * sizeof (uint16_t));
+
+	dirty = 0;
+	update_cursor(row * VGA_SCREEN_COLUMNS + col);
+}
 
-	if (n >= VGA_SCREEN_LINES * VGA_SCREEN_COLUMNS) {
-		scroll();
-		n -= VGA_SCREEN_COLUMNS;
-	}
 
-	update_cursor(n);
+void clear(void)
+{
+	size_t line;
+
+	for (line = 0; line < VGA_SCREEN_LINES; line++)
+		clear_line(shadow[line]);
+
+	top = 0;
+	row = 0;
+	col = 0;
+	dirty = (1u << VGA_SCREEN_LINES) - 1;
+	flush_screen();
+}
+
+void putc(char c)
+{
+	write_char(c);
+	flush_screen();
 }
 
 void puts(const char *str, size_t n)
@@ -91,5 +126,7 @@ void puts(const char *str, size_t n)
 	size_t i;
 
 	for (i = 0; i < n; i++)
-		putc(str[i]);
+		write_char(str[i]);
+
+	flush_screen();
 }
@@ -0,0 +1,384 @@
+#include <printk.h>
+#include <task.h>
+#include <types.h>
+#include <vma.h>
+
+
+#define RED    0
+#define BLACK  1
+
+#define NODE(ctx, i)  ((ctx)->vmas + (i))
+
+
+static uint8_t color(struct task *ctx, uint8_t i)
+{
+	return (i == VMA_NIL) ? BLACK : NODE(ctx, i)->color;
+}
+
+static void set_parent(struct task *ctx, uint8_t i, uint8_t parent)
+{
+	if (i != VMA_NIL)
+		NODE(ctx, i)->parent = parent;
+}
+
+/* Put v in place of u in the parent of u */
+static void replace_child(struct task *ctx, uint8_t u, uint8_t v)
+{
+	uint8_t p = NODE(ctx, u)->parent;
+
+	if (p == VMA_NIL)
+		ctx->vma_root = v;
+	else if (NODE(ctx, p)->left == u)
+		NODE(ctx, p)->left = v;
+	else
+		NODE(ctx, p)->right = v;
+
+	set_parent(ctx, v, p);
+}
+
+static void rotate_left(struct task *ctx, uint8_t x)
+{
+	uint8_t y = NODE(ctx, x)->right;
+
+	NODE(ctx, x)->right = NODE(ctx, y)->left;
+	set_parent(ctx, NODE(ctx, y)->left, x);
+	replace_child(ctx, x, y);
+	NODE(ctx, y)->left = x;
+	NODE(ctx, x)->parent = y;
+}
+
+static void rotate_right(struct task *ctx, uint8_t x)
+{
+	uint8_t y = NODE(ctx, x)->left;
+
+	NODE(ctx, x)->left = NODE(ctx, y)->right;
+	set_parent(ctx, NODE(ctx, y)->right, x);
+	replace_child(ctx, x, y);
+	NODE(ctx, y)->right = x;
+	NODE(ctx, x)->parent = y;
+}
+
+static void insert_fixup(struct task *ctx, uint8_t x)
+{
+	uint8_t p, g, u;
+
+	while ((p = NODE(ctx, x)->parent) != VMA_NIL
+	       && NODE(ctx, p)->color == RED) {
+		g = NODE(ctx, p)->parent;
+
+		if (p == NODE(ctx, g)->left) {
+			u = NODE(ctx, g)->right;
+			if (color(ctx, u) == RED) {
+				NODE(ctx, p)->color = BLACK;
+				NODE(ctx, u)->color = BLACK;
+				NODE(ctx, g)->color = RED;
+				x = g;
+				continue;
+			}
+			if (x == NODE(ctx, p)->right) {
+				rotate_left(ctx, p);
+				x = p;
+				p = NODE(ctx, x)->parent;
+			}
+			NODE(ctx, p)->color = BLACK;
+			NODE(ctx, g)->color = RED;
+			rotate_right(ctx, g);
+		} else {
+			u = NODE(ctx, g)->left;
+			if (color(ctx, u) == RED) {
+				NODE(ctx, p)->color = BLACK;
+				NODE(ctx, u)->color = BLACK;
+				NODE(ctx, g)->color = RED;
+				x = g;
+				continue;
+			}
+			if (x == NODE(ctx, p)->left) {
+				rotate_right(ctx, p);
+				x = p;
+				p = NODE(ctx, x)->parent;
+			}
+			NODE(ctx, p)->color = BLACK;
+			NODE(ctx, g)->color = RED;
+			rotate_left(ctx, g);
+		}
+	}
+
+	NODE(ctx, ctx->vma_root)->color = BLACK;
+}
+
+/* x (maybe VMA_NIL) child of p lacks one black node on its paths */
+static void erase_fixup(struct task *ctx, uint8_t x, uint8_t p)
+{
+	uint8_t w;
+
+	while (x != ctx->vma_root && color(ctx, x) == BLACK) {
+		if (x == NODE(ctx, p)->left) {
+			w = NODE(ctx, p)->right;
+			if (NODE(ctx, w)->color == RED) {
+				NODE(ctx, w)->color = BLACK;
+				NODE(ctx, p)->color = RED;
+				rotate_left(ctx, p);
+				w = NODE(ctx, p)->right;
+			}
+			if (color(ctx, NODE(ctx, w)->left) == BLACK
+			    && color(ctx, NODE(ctx, w)->right) == BLACK) {
+				NODE(ctx, w)->color = RED;
+				x = p;
+				p = NODE(ctx, x)->parent;
+				continue;
+			}
+			if (color(ctx, NODE(ctx, w)->right) == BLACK) {
+				NODE(ctx, NODE(ctx, w)->left)->color = BLACK;
+				NODE(ctx, w)->color = RED;
+				rotate_right(ctx, w);
+				w = NODE(ctx, p)->right;
+			}
+			NODE(ctx, w)->color = NODE(ctx, p)->color;
+			NODE(ctx, p)->color = BLACK;
+			NODE(ctx, NODE(ctx, w)->right)->color = BLACK;
+			rotate_left(ctx, p);
+		} else {
+			w = NODE(ctx, p)->left;
+			if (NODE(ctx, w)->color == RED) {
+				NODE(ctx, w)->color = BLACK;
+				NODE(ctx, p)->color = RED;
+				rotate_right(ctx, p);
+				w = NODE(ctx, p)->left;
+			}
+			if (color(ctx, NODE(ctx, w)->left) == BLACK
+			    && color(ctx, NODE(ctx, w)->right) == BLACK) {
+				NODE(ctx, w)->color = RED;
+				x = p;
+				p = NODE(ctx, x)->parent;
+				continue;
+			}
+			if (color(ctx, NODE(ctx, w)->left) == BLACK) {
+				NODE(ctx, NODE(ctx, w)->right)->color = BLACK;
+				NODE(ctx, w)->color = RED;
+				rotate_left(ctx, w);
+				w = NODE(ctx, p)->left;
+			}
+			NODE(ctx, w)->color = NODE(ctx, p)->color;
+			NODE(ctx, p)->color = BLACK;
+			NODE(ctx, NODE(ctx, w)->left)->color = BLACK;
+			rotate_right(ctx, p);
+		}
+		x = ctx->vma_root;
+	}
+
+	if (x != VMA_NIL)
+		NODE(ctx, x)->color = BLACK;
+}
+
+static void erase(struct task *ctx, uint8_t z)
+{
+	struct vma *n = NODE(ctx, z);
+	uint8_t x, p, y = z, y_color = n->color;
+
+	if (n->left == VMA_NIL) {
+		x = n->right;
+		p = n->parent;
+		replace_child(ctx, z, x);
+	} else if (n->right == VMA_NIL) {
+		x = n->left;
+		p = n->parent;
+		replace_child(ctx, z, x);
+	} else {
+		/* Successeur de z : le plus petit de son sous-arbre droit */
+		y = n->right;
+		while (NODE(ctx, y)->left != VMA_NIL)
+			y = NODE(ctx, y)->left;
+		y_color = NODE(ctx, y)->color;
+		x = NODE(ctx, y)->right;
+
+		if (NODE(ctx, y)->parent == z) {
+			p = y;
+		} else {
+			p = NODE(ctx, y)->parent;
+			replace_child(ctx, y, x);
+			NODE(ctx, y)->right = n->right;
+			set_parent(ctx, n->right, y);
+		}
+
+		replace_child(ctx, z, y);
+		NODE(ctx, y)->left = n->left;
+		set_parent(ctx, n->left, y);
+		NODE(ctx, y)->color = n->color;
+	}
+
+	if (y_color == BLACK)
+		erase_fixup(ctx, x, p);
+
+	n->right = ctx->vma_free;
+	ctx->vma_free = z;
+}
+
+static int insert(struct task *ctx, vaddr_t start, vaddr_t end,
+		  uint8_t type, uint8_t prot, paddr_t paddr)
+{
+	uint8_t z = ctx->vma_free, p = VMA_NIL, i = ctx->vma_root;
+	struct vma *n;
+
+	if (z == VMA_NIL) {
+		printk("[error] add_vma: too many areas\n");
+		return -1;
+	}
+
+	while (i != VMA_NIL) {
+		p = i;
+		i = (start < NODE(ctx, i)->start) ? NODE(ctx, i)->left
+			: NODE(ctx, i)->right;
+	}
+
+	n = NODE(ctx, z);
+	ctx->vma_free = n->right;
+
+	n->start = start;
+	n->end = end;
+	n->paddr = paddr;
+	n->type = type;
+	n->prot = prot;
+	n->color = RED;
+	n->parent = p;
+	n->left = VMA_NIL;
+	n->right = VMA_NIL;
+
+	if (p == VMA_NIL)
+		ctx->vma_root = z;
+	else if (start < NODE(ctx, p)->start)
+		NODE(ctx, p)->left = z;
+	else
+		NODE(ctx, p)->right = z;
+
+	insert_fixup(ctx, z);
+	return 0;
+}
+
+/* Lowest area ending after vaddr, i.e. containing or following vaddr */
+static uint8_t lower_bound(struct task *ctx, vaddr_t vaddr)
+{
+	uint8_t i = ctx->vma_root, best = VMA_NIL;
+
+	while (i != VMA_NIL) {
+		if (vaddr < NODE(ctx, i)->end) {
+			best = i;
+			i = NODE(ctx, i)->left;
+		} else {
+			i = NODE(ctx, i)->right;
+		}
+	}
+
+	return best;
+}
+
+/* Zero filled areas of same kind that touch each other can be merged */
+static int can_merge(const struct vma *vma, uint8_t type, uint8_t prot,
+		     paddr_t paddr)
+{
+	return vma->type == type && vma->prot == prot && type != VMA_IMAGE
+		&& vma->paddr == 0 && paddr == 0;
+}
+
+/* Frame backing vaddr in the area n, or 0 if it is zero filled */
+static paddr_t backing(const struct vma *n, vaddr_t vaddr)
+{
+	return (n->paddr == 0) ? 0 : n->paddr + (vaddr - n->start);
+}
+
+
+void init_vmas(struct task *ctx)
+{
+	uint8_t i;
+
+	for (i = 0; i < TASK_VMA_MAX; i++)
+		ctx->vmas[i].right = (i + 1 < TASK_VMA_MAX) ? i + 1 : VMA_NIL;
+
+	ctx->vma_root = VMA_NIL;
+	ctx->vma_free = 0;
+}
+
+int add_vma(struct task *ctx, vaddr_t start, vaddr_t end, uint8_t type,
+	    uint8_t prot, paddr_t paddr)
+{
+	uint8_t prev = VMA_NIL, next;
+
+	if (start >= end)
+		return 0;
+
+	next = lower_bound(ctx, start);
+	if (next != VMA_NIL && NODE(ctx, next)->start < end) {
+		printk("[error] add_vma: [%p, %p) overlaps an area\n",
+		       start, end);
+		return -1;
+	}
+
+	if (start > 0) {
+		prev = lower_bound(ctx, start - 1);
+		if (prev != VMA_NIL && NODE(ctx, prev)->end != start)
+			prev = VMA_NIL;
+	}
+
+	/* Etendre la zone precedente plutot que d'en creer une nouvelle */
+	if (prev != VMA_NIL && can_merge(NODE(ctx, prev), type, prot, paddr)) {
+		NODE(ctx, prev)->end = end;
+
+		if (next != VMA_NIL && NODE(ctx, next)->start == end
+		    && can_merge(NODE(ctx, next), type, prot, paddr)) {
+			NODE(ctx, prev)->end = NODE(ctx, next)->end;
+			erase(ctx, next);
+		}
+		return 0;
+	}
+
+	if (next != VMA_NIL && NODE(ctx, next)->start == end
+	    && can_merge(NODE(ctx, next), type, prot, paddr)) {
+		NODE(ctx, next)->start = start;
+		return 0;
+	}
+
+	return insert(ctx, start, end, type, prot, paddr);
+}
+
+int remove_vmas(struct task *ctx, vaddr_t start, vaddr_t end)
+{
+	struct vma *n;
+	uint8_t i;
+
+	while ((i = lower_bound(ctx, start)) != VMA_NIL
+	       && NODE(ctx, i)->start < end) {
+		n = NODE(ctx, i);
+
+		if (n->start >= start && n->end <= end) {
+			erase(ctx, i);
+		} else if (n->start < start && n->end > end) {
+			/* Trou au milieu de la zone : elle est coupee en deux */
+			if (insert(ctx, end, n->end, n->type, n->prot,
+				   backing(n, end)) != 0)
+				return -1;
+			n->end = start;
+		} else if (n->start < start) {
+			n->end = start;
+		} else {
+			n->paddr = backing(n, end);
+			n->start = end;
+		}
+	}
+
+	return 0;
+}
+
+const struct vma *find_vma(struct task *ctx, vaddr_t vaddr)
+{
+	uint8_t i = ctx->vma_root;
+
+	while (i != VMA_NIL) {
+		if (vaddr < NODE(ctx, i)->start)
+			i = NODE(ctx, i)->left;
+		else if (vaddr >= NODE(ctx, i)->end)
+			i = NODE(ctx, i)->right;
+		else
+			return NODE(ctx, i);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,63 @@
+#include <string.h>
+#include <syscall.h>
+#include <x86.h>
+
+
+#define ROUNDS   1024
+
+
+extern char __task_start;
+extern char __task_end;
+extern char __bss_end;
+
+
+static uint64_t round_trip(void)
+{
+	uint64_t start = rdtsc();
+
+	syscall_nop();
+
+	return rdtsc() - start;
+}
+
+
+void entry(void)
+{
+	uint64_t warm = 0, cold = 0;
+	size_t i;
+
+	syscall_print("  ==> Latency Task\n");
+
+	round_trip();
+
+	/* Back to back system calls: kernel translations are in the TLB */
+	for (i = 0; i < ROUNDS; i++)
+		warm += round_trip();
+
+	/*
+	 * First system call after a CR3 switch: only the global kernel
+	 * translations survived the switch.
+	 */
+	for (i = 0; i < ROUNDS; i++) {
+		syscall_yield();
+		cold += round_trip();
+	}
+
+	syscall_print("  --> Latency result: ");
+	syscall_printnum(warm / ROUNDS);
+	syscall_print(" cycles, ");
+	syscall_printnum(cold / ROUNDS);
+	syscall_print(" cycles after a switch\n");
+
+	syscall_exit();
+}
+
+
+struct task_header header __attribute__((section(".header"))) = {
+	.magic = TASK_HEADER_MAGIC,
+	.load_addr = (vaddr_t) &__task_start,
+	.load_end_addr = (vaddr_t) &__task_end,
+	.bss_end_addr = (vaddr_t) &__bss_end,
+	.header_addr = (vaddr_t) &header,
+	.entry_addr = (vaddr_t) &entry
+};
@@ -0,0 +1,109 @@
+#include <string.h>
+#include <syscall.h>
+#include <x86.h>
+
+#include "pingpong.h"
+
+
+extern char __task_start;
+extern char __task_end;
+extern char __bss_end;
+
+
+/* Round trips of a single message: the cost of a wakeup on each side */
+static uint64_t latency(struct pingpong *pp)
+{
+	uint64_t start = rdtsc();
+	struct message *msg;
+	uint32_t i;
+
+	for (i = 0; i < PINGPONG_ROUNDS; i++) {
+		msg = shm_ring_reserve(&pp->ping);
+		msg->kind = MSG_ECHO;
+		msg->seq = i;
+		shm_ring_publish(&pp->ping);
+
+		msg = shm_ring_peek(&pp->pong);
+		if (msg->kind != MSG_ECHO || msg->seq != i)
+			return 0;
+		shm_ring_release(&pp->pong);
+	}
+
+	return (rdtsc() - start) / PINGPONG_ROUNDS;
+}
+
+/*
+ * One way stream: the producer fills slots while the consumer drains
+ * them, neither sleeps as long as the other keeps up. Return the bytes
+ * moved per 1000 cycles, or 0 if pong did not see the same data.
+ */
+static uint64_t throughput(struct pingpong *pp)
+{
+	uint64_t start = rdtsc(), sum = 0;
+	struct message *msg;
+	uint32_t i;
+
+	for (i = 0; i < PINGPONG_BULK; i++) {
+		msg = shm_ring_reserve(&pp->ping);
+		msg->kind = MSG_DATA;
+		msg->seq = i;
+		memset(msg->data, i & 0xff, sizeof (msg->data));
+		shm_ring_publish(&pp->ping);
+
+		sum += (sizeof (msg->data) / 8) * 0x0101010101010101ul
+			* (i & 0xff);
+	}
+
+	msg = shm_ring_reserve(&pp->ping);
+	msg->kind = MSG_STOP;
+	msg->seq = i;
+	shm_ring_publish(&pp->ping);
+
+	msg = shm_ring_peek(&pp->pong);
+	if (msg->kind != MSG_STOP || msg->sum != sum)
+		return 0;
+	shm_ring_release(&pp->pong);
+
+	return PINGPONG_BULK * sizeof (msg->data) * 1000 / (rdtsc() - start);
+}
+
+
+void entry(void)
+{
+	struct pingpong *pp;
+	uint64_t cycles, rate;
+
+	syscall_print("  ==> Ping Task\n");
+
+	pp = pingpong_attach();
+	if (pp == NULL) {
+		syscall_print("  --> Ping-pong result: failure (attach)\n");
+		syscall_exit();
+	}
+
+	cycles = latency(pp);
+	rate = throughput(pp);
+
+	if (cycles == 0 || rate == 0) {
+		syscall_print("  --> Ping-pong result: failure\n");
+		syscall_exit();
+	}
+
+	syscall_print("  --> Ping-pong result: success, ");
+	syscall_printnum(cycles);
+	syscall_print(" cycles per round trip, ");
+	syscall_printnum(rate);
+	syscall_print(" bytes per 1000 cycles\n");
+
+	syscall_exit();
+}
+
+
+struct task_header header __attribute__((section(".header"))) = {
+	.magic = TASK_HEADER_MAGIC,
+	.load_addr = (vaddr_t) &__task_start,
+	.load_end_addr = (vaddr_t) &__task_end,
+	.bss_end_addr = (vaddr_t) &__bss_end,
+	.header_addr = (vaddr_t) &header,
+	.entry_addr = (vaddr_t) &entry
+};
@@ -0,0 +1,47 @@
+#ifndef _TASK_PINGPONG_H_
+#define _TASK_PINGPONG_H_
+
+
+#include <syscall.h>
+
+
+/* Shared by the ping and pong tasks, see ping.c */
+#define PINGPONG_NAME      "pingpong"
+#define PINGPONG_VADDR     0x3000000000
+#define PINGPONG_ROUNDS    4096          /* latency: one message in flight */
+#define PINGPONG_BULK      16384       /* throughput: messages in one way */
+
+#define MSG_ECHO           1                      /* sent back as is */
+#define MSG_DATA           2            /* summed, no answer expected */
+#define MSG_STOP           3       /* answered with the sum, then exit */
+
+
+struct pingpong
+{
+	struct shm_ring  ping;                            /* ping to pong */
+	struct shm_ring  pong;                            /* pong to ping */
+};
+
+/* A message fills a slot of the rings, written and read in place */
+struct message
+{
+	uint32_t  kind;
+	uint32_t  seq;
+	uint64_t  sum;                           /* of data, for MSG_STOP */
+	uint64_t  data[(SHM_RING_SLOT_SIZE - 16) / 8];
+};
+
+
+/* Whichever task comes first creates the region, both attach it */
+static inline struct pingpong *pingpong_attach(void)
+{
+	syscall_shm_create(PINGPONG_NAME, sizeof (struct pingpong));
+
+	if (syscall_shm_attach(PINGPONG_NAME, PINGPONG_VADDR) < 0)
+		return NULL;
+
+	return (struct pingpong *) PINGPONG_VADDR;
+}
+
+
+#endif
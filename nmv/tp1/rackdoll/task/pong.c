@@ -0,0 +1,57 @@
+#include <syscall.h>
+
+#include "pingpong.h"
+
+
+extern char __task_start;
+extern char __task_end;
+extern char __bss_end;
+
+
+/* Answer ping until it says stop, reading every message in place */
+void entry(void)
+{
+	struct message *in, *out;
+	struct pingpong *pp;
+	uint64_t sum = 0;
+	uint32_t kind;
+	size_t i;
+
+	syscall_print("  ==> Pong Task\n");
+
+	pp = pingpong_attach();
+	if (pp == NULL) {
+		syscall_print("  --> Pong result: failure (attach)\n");
+		syscall_exit();
+	}
+
+	do {
+		in = shm_ring_peek(&pp->ping);
+		kind = in->kind;
+
+		if (kind == MSG_DATA) {
+			for (i = 0; i < sizeof (in->data) / 8; i++)
+				sum += in->data[i];
+		} else {
+			out = shm_ring_reserve(&pp->pong);
+			out->kind = kind;
+			out->seq = in->seq;
+			out->sum = sum;
+			shm_ring_publish(&pp->pong);
+		}
+
+		shm_ring_release(&pp->ping);
+	} while (kind != MSG_STOP);
+
+	syscall_exit();
+}
+
+
+struct task_header header __attribute__((section(".header"))) = {
+	.magic = TASK_HEADER_MAGIC,
+	.load_addr = (vaddr_t) &__task_start,
+	.load_end_addr = (vaddr_t) &__task_end,
+	.bss_end_addr = (vaddr_t) &__bss_end,
+	.header_addr = (vaddr_t) &header,
+	.entry_addr = (vaddr_t) &entry
+};
@@ -22,11 +22,8 @@ static unsigned long *number_array(unsigned long max, int init)
 	if (n & (PAGE_SIZE - 1))
 		n = (n + PAGE_SIZE) & ~(PAGE_SIZE - 1);
 
-	while (n > 0) {
-		syscall_mmap(heap);
-		heap += PAGE_SIZE;
-		n -= PAGE_SIZE;
-	}
+	syscall_mmap_range(heap, n);
+	heap += n;
 
 	if (init == 0)
 		return ret;
@@ -41,16 +38,18 @@ static void realloc_array(unsigned long *arr, unsigned long max)
 {
 	size_t n = max * 8;
 	vaddr_t addr = (vaddr_t) arr;
+	struct syscall_cqe cqe;
 
 	if (n & (PAGE_SIZE - 1))
 		n = (n + PAGE_SIZE) & ~(PAGE_SIZE - 1);
 
-	while (n > 0) {
-		syscall_munmap(addr);
-		syscall_mmap(addr);
-		addr += PAGE_SIZE;
-		n -= PAGE_SIZE;
-	}
+	/* Both calls in a single trip to the kernel */
+	ring_submit(SYSCALL_MUNMAP_RANGE, addr, n, 0);
+	ring_submit(SYSCALL_MMAP_RANGE, addr, n, 0);
+	syscall_ring_enter();
+
+	while (ring_reap(&cqe) == 0)
+		;
 }
 
 static size_t filter(unsigned long *to, const unsigned long *from,
@@ -0,0 +1,215 @@
+#include <syscall.h>
+#include <x86.h>
+
+
+#define PAGE_SIZE    4096
+#define MAX_SEARCH   65536
+#define MAX_PRIME    256                   /* sqrt(MAX_SEARCH) is enough */
+#define ROUNDS       1024
+
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+
+extern char __task_start;
+extern char __task_end;
+extern char __bss_end;
+
+
+vaddr_t heap = (vaddr_t) &__bss_end;
+
+
+static uint32_t *number_array(void)
+{
+	size_t n = MAX_SEARCH * sizeof (uint32_t);
+	uint32_t *ret = (uint32_t *) heap;
+
+	n = (n + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	syscall_mmap_range(heap, n);
+	heap += n;
+
+	return ret;
+}
+
+static void init_array(uint32_t *num)
+{
+	uint32_t i;
+
+	for (i = 0; i < MAX_SEARCH; i++)
+		num[i] = i;
+
+	num[0] = 0;
+	num[1] = 0;
+}
+
+/* Inverse of an odd p modulo 2^32, by Newton iterations */
+static uint32_t inverse(uint32_t p)
+{
+	uint32_t inv = p;                            /* right on 3 bits */
+	size_t i;
+
+	for (i = 0; i < 4; i++)
+		inv *= 2 - p * inv;
+
+	return inv;
+}
+
+/*
+ * No division in the inner loop: for an odd p, x is a multiple of p if and
+ * only if x * inverse(p) mod 2^32 is at most (2^32 - 1) / p. Both versions
+ * cross out the multiples of every prime, the vector one 4 numbers at once.
+ */
+__attribute__((optimize("no-tree-vectorize")))
+static void sieve_scalar(uint32_t *num)
+{
+	uint32_t p, inv, lim;
+	size_t i;
+
+	for (i = 4; i < MAX_SEARCH; i += 2)
+		num[i] = 0;
+
+	for (p = 3; p < MAX_PRIME; p += 2) {
+		if (num[p] == 0)
+			continue;
+
+		inv = inverse(p);
+		lim = 0xffffffff / p;
+
+		for (i = p + 1; i < MAX_SEARCH; i++)
+			if (num[i] * inv <= lim)
+				num[i] = 0;
+	}
+}
+
+static void sieve_vector(uint32_t *num)
+{
+	v4u32 *vec = (v4u32 *) num;
+	v4u32 even = { 0, 0xffffffff, 0, 0xffffffff };
+	v4u32 inv, lim, self;
+	uint32_t p;
+	size_t i;
+
+	/* The first vector holds 2 itself and no other even number but 0 */
+	for (i = 1; i < MAX_SEARCH / 4; i++)
+		vec[i] &= even;
+
+	for (p = 3; p < MAX_PRIME; p += 2) {
+		if (num[p] == 0)
+			continue;
+
+		inv = (v4u32) { 0, 0, 0, 0 } + inverse(p);
+		lim = (v4u32) { 0, 0, 0, 0 } + 0xffffffff / p;
+		self = (v4u32) { 0, 0, 0, 0 } + p;
+
+		for (i = 0; i < MAX_SEARCH / 4; i++)
+			vec[i] &= ~((vec[i] * inv <= lim) & (vec[i] != self));
+	}
+}
+
+static size_t count(const uint32_t *num)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < MAX_SEARCH; i++)
+		if (num[i] != 0)
+			n++;
+
+	return n;
+}
+
+static uint64_t run(uint32_t *num, void (*sieve)(uint32_t *), size_t *found)
+{
+	uint64_t start;
+
+	init_array(num);
+
+	start = rdtsc();
+	sieve(num);
+	start = rdtsc() - start;
+
+	*found = count(num);
+	return start;
+}
+
+/*
+ * ROUNDS yields without touching the SIMD registers, then ROUNDS touching
+ * them after each one. A forked partner does the same: on a shared cpu
+ * every yield switches to it, and in the second loop each side takes the
+ * registers back from the other with a #NM trap and a state restore.
+ * Return the number of restores of the second loop, which tells whether
+ * the partner really ran in between (or was stolen by another cpu).
+ */
+static uint64_t yield_loops(uint64_t *idle, uint64_t *busy)
+{
+	uint64_t start, restores;
+	size_t i;
+
+	start = rdtsc();
+	for (i = 0; i < ROUNDS; i++)
+		syscall_yield();
+	*idle = (rdtsc() - start) / ROUNDS;
+
+	restores = syscall_fpu_restores();
+	start = rdtsc();
+	for (i = 0; i < ROUNDS; i++) {
+		syscall_yield();
+		asm volatile ("pxor %%xmm0, %%xmm0" : : : "xmm0");
+	}
+	*busy = (rdtsc() - start) / ROUNDS;
+
+	return syscall_fpu_restores() - restores;
+}
+
+static uint64_t yield_cost(uint64_t *idle, uint64_t *busy)
+{
+	uint64_t restores;
+	int child = syscall_fork();
+
+	restores = yield_loops(idle, busy);
+	if (child == 1)
+		syscall_exit();
+
+	return restores;
+}
+
+/* The initial user stack is not aligned like a call left it */
+__attribute__((force_align_arg_pointer))
+void entry(void)
+{
+	uint32_t *num = number_array();
+	uint64_t scalar, vector, idle, busy, restores;
+	size_t nscalar, nvector;
+
+	syscall_print("  ==> SIMD Sieve Task\n");
+
+	scalar = run(num, sieve_scalar, &nscalar);
+	vector = run(num, sieve_vector, &nvector);
+	restores = yield_cost(&idle, &busy);
+
+	if (nscalar == 6542 && nvector == 6542)
+		syscall_print("  --> SIMD sieve result: success, scalar ");
+	else
+		syscall_print("  --> SIMD sieve result: failure, scalar ");
+	syscall_printnum(scalar);
+	syscall_print(" cycles, sse ");
+	syscall_printnum(vector);
+	syscall_print(" cycles\n  --> SIMD sieve yield: ");
+	syscall_printnum(idle);
+	syscall_print(" cycles, ");
+	syscall_printnum(busy);
+	syscall_print(" cycles with SIMD state (");
+	syscall_printnum(restores);
+	syscall_print(" restores)\n");
+
+	syscall_exit();
+}
+
+
+struct task_header header __attribute__((section(".header"))) = {
+	.magic = TASK_HEADER_MAGIC,
+	.load_addr = (vaddr_t) &__task_start,
+	.load_end_addr = (vaddr_t) &__task_end,
+	.bss_end_addr = (vaddr_t) &__bss_end,
+	.header_addr = (vaddr_t) &header,
+	.entry_addr = (vaddr_t) &entry
+};
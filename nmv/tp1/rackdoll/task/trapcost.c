@@ -0,0 +1,67 @@
+#include <syscall.h>
+#include <x86.h>
+
+
+#define ROUNDS   4096
+
+
+extern char __task_start;
+extern char __task_end;
+extern char __bss_end;
+
+
+/* Both paths enter the kernel with interrupts off, see int_syscall() */
+static uint64_t cost_int(void)
+{
+	uint64_t start = rdtsc();
+	size_t i;
+
+	for (i = 0; i < ROUNDS; i++)
+		int_syscall(SYSCALL_NOP, 0);
+
+	return (rdtsc() - start) / ROUNDS;
+}
+
+static uint64_t cost_syscall(void)
+{
+	uint64_t start = rdtsc();
+	size_t i;
+
+	for (i = 0; i < ROUNDS; i++)
+		syscall(SYSCALL_NOP, 0);
+
+	return (rdtsc() - start) / ROUNDS;
+}
+
+
+void entry(void)
+{
+	uint64_t slow, fast;
+
+	syscall_print("  ==> Trap Cost Task\n");
+
+	/* Warm up the caches and the TLB on both paths */
+	cost_int();
+	cost_syscall();
+
+	slow = cost_int();
+	fast = cost_syscall();
+
+	syscall_print("  --> Trap cost result: int $0x80 ");
+	syscall_printnum(slow);
+	syscall_print(" cycles, syscall ");
+	syscall_printnum(fast);
+	syscall_print(" cycles\n");
+
+	syscall_exit();
+}
+
+
+struct task_header header __attribute__((section(".header"))) = {
+	.magic = TASK_HEADER_MAGIC,
+	.load_addr = (vaddr_t) &__task_start,
+	.load_end_addr = (vaddr_t) &__task_end,
+	.bss_end_addr = (vaddr_t) &__bss_end,
+	.header_addr = (vaddr_t) &header,
+	.entry_addr = (vaddr_t) &entry
+};